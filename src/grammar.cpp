@@ -1,23 +1,41 @@
 #include "grammar.h"
 #include <ncursesw/ncurses.h>
 #include <cwchar>
+#include <cwctype>
 #include <cstring>
 #include <sys/stat.h>
 #include <zlib.h>
-#include <fstream>
 #include <algorithm>
 #include <climits>
+#include <cmath>
+#include <chrono>
+
+// SplitMix64 finalizer, mixes all input bits into all output bits
+static inline uint64_t mix64(uint64_t v) {
+    v += 0x9e3779b97f4a7c15ULL;
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+    return v ^ (v >> 31);
+}
+
+static inline uint64_t cellKey(int r, int c) {
+    return static_cast<uint64_t>(static_cast<uint32_t>(r)) << 32 | static_cast<uint32_t>(c);
+}
+
+// Hash contribution of a character recorded in x (absent and space count alike)
+static inline uint64_t recordedHash(const std::pair<int, int> &pos, wchar_t ch) {
+    if (ch == L' ') return 0;
+    return mix64(mix64(cellKey(pos.first, pos.second)) ^ static_cast<uint32_t>(ch) ^ 0x5851f42d00000000ULL);
+}
 
-// Define static mutex for thread-safe screen operations
-std::mutex Derivation::screen_mutex;
+// LHS symbol of a rule header
+static wchar_t ruleSymbol(const std::wstring &lhs) {
+    return lhs.length() > 2 ? lhs[2] : L's';
+}
 
 // Global thread pool (created once, reused across programs)
 std::unique_ptr<ThreadPool> Derivation::global_thread_pool;
 
-// Static variables for threading stats
-static int g_total_steps = 0;
-static int g_parallel_steps = 0;
-
 // ThreadPool implementation
 ThreadPool::ThreadPool(size_t threads) : stop(false) {
     for(size_t i = 0; i < threads; ++i) {
@@ -69,40 +87,98 @@ ThreadPool::~ThreadPool() {
         worker.join();
 }
 
-static std::string decompress_gzip_file(const std::string& filename) {
-    gzFile file = gzopen(filename.c_str(), "rb");
-    if (!file) return "";
-
-    std::string result;
-    char buffer[4096];
-    int bytes_read;
+// Chunk size of reading program files
+static const unsigned READ_CHUNK = 1 << 16;
+
+// UTF-8 decoder of program text fed in chunks, passing on complete lines.
+// A sequence split between chunks is finished by the next one; bytes that
+// do not form a valid sequence are taken as single characters (Latin-1).
+class LineDecoder {
+public:
+    template<class Emit> void feed(const char *data, size_t size, Emit &&emit) {
+        for (size_t i = 0; i < size; ++i) {
+            if (need == 0) {
+                // Run of plain ASCII characters
+                size_t end = i;
+                while (end < size && static_cast<unsigned char>(data[end]) < 0x80 && data[end] != '\n') ++end;
+                size_t at = line.size();
+                line.resize(at + (end - i));
+                for (wchar_t *out = &line[0] + at; i < end; ++i) *out++ = static_cast<wchar_t>(data[i]);
+                if (i == size) break;
+            }
+            unsigned char b = static_cast<unsigned char>(data[i]);
+            if (need > 0) {
+                if ((b & 0xC0) == 0x80) {
+                    code = code << 6 | (b & 0x3F);
+                    bytes[got++] = b;
+                    if (--need == 0) line.push_back(static_cast<wchar_t>(code));
+                    continue;
+                }
+                broken();
+            }
+            if (b == '\n') {
+                emit(line);
+                line.clear();
+            } else if (b < 0x80) {
+                line.push_back(static_cast<wchar_t>(b));
+            } else if ((b & 0xE0) == 0xC0) {
+                start(b, b & 0x1F, 1);
+            } else if ((b & 0xF0) == 0xE0) {
+                start(b, b & 0x0F, 2);
+            } else if ((b & 0xF8) == 0xF0) {
+                start(b, b & 0x07, 3);
+            } else {
+                line.push_back(static_cast<wchar_t>(b));
+            }
+        }
+    }
 
-    while ((bytes_read = gzread(file, buffer, sizeof(buffer))) > 0) {
-        result.append(buffer, bytes_read);
+    // Pass on the last line (unless the text ended with a newline)
+    template<class Emit> void finish(Emit &&emit) {
+        if (need > 0) broken();
+        if (!line.empty()) emit(line);
+        line.clear();
     }
 
-    gzclose(file);
-    return result;
-}
+private:
+    void start(unsigned char b, uint32_t bits, int count) {
+        bytes[0] = b;
+        got = 1;
+        code = bits;
+        need = count;
+    }
 
-bool Grammar2D::_process(const std::vector<std::wstring> &lhs, const std::wstring &rule) {
-    for (const auto &x : lhs) {
-        addRule(x, rule);
+    // Pass on the bytes of a sequence cut short one by one
+    void broken() {
+        for (int i = 0; i < got; ++i) line.push_back(static_cast<wchar_t>(bytes[i]));
+        need = 0;
     }
-    return true;
+
+    std::wstring line;
+    uint32_t code = 0;
+    unsigned char bytes[4] = {};  // of the sequence being decoded
+    int got = 0;
+    int need = 0;  // continuation bytes missing
+};
+
+std::pair<std::string, std::string> Grammar2D::splitSection(const std::string &config) {
+    size_t mark = config.find_last_of('#');
+    if (mark == std::string::npos || config.find('/', mark) != std::string::npos) return {config, ""};
+    return {config.substr(0, mark), config.substr(mark + 1)};
 }
 
-bool Grammar2D::loadFromFile(const std::string &fname) {
+bool Grammar2D::loadFromFile(const std::string &fname, const Grammar2D *previous) {
     struct stat buffer;
-    std::string filename = fname;
+    auto [file, name] = splitSection(fname);
+    std::string filename = file;
 
     // Try original filename first (only if it's a regular file)
     if (stat(filename.c_str(), &buffer) == 0 && S_ISREG(buffer.st_mode)) {
         // File exists as-is
     }
     // If not .cfg, try adding /index.cfg
-    else if (!fname.ends_with(".cfg") && !fname.ends_with(".cfg.gz")) {
-        filename = fname + "/index.cfg";
+    else if (!file.ends_with(".cfg") && !file.ends_with(".cfg.gz")) {
+        filename = file + "/index.cfg";
         if (stat(filename.c_str(), &buffer) != 0) {
             filename += ".gz";
             if (stat(filename.c_str(), &buffer) != 0) {
@@ -112,146 +188,346 @@ bool Grammar2D::loadFromFile(const std::string &fname) {
     }
     // Try adding .gz to original filename
     else {
-        filename = fname + ".gz";
+        filename = file + ".gz";
         if (stat(filename.c_str(), &buffer) != 0) {
             return false;
         }
     }
 
-    std::string content;
-    if (filename.ends_with(".gz")) {
-        content = decompress_gzip_file(filename);
-        if (content.empty()) return false;
-    } else {
-        std::ifstream file(filename);
-        if (!file.is_open()) return false;
-        content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
-    }
-
-    std::vector<std::wstring> lhs;
-    std::wstring rule;
-
-    bool first = true;
-    size_t start = 0;
-    while (start < content.length()) {
-        size_t end = content.find('\n', start);
-        if (end == std::string::npos) end = content.length();
-        std::string line_utf8 = content.substr(start, end - start);
-        start = end + 1;
-        std::wstring line = string_to_wstring(line_utf8);
-        if (!line.empty() && line[0] == '#') //comment
-        {
-            if (line.size() > 1) {
-                if (first && line[1] == L'!') {
-                    help = line.substr(2);
-                } else {
-                    // New keyword-based parsing
-                    std::wstring keyword;
-                    size_t space_pos = line.find(L' ', 1);
-                    if (space_pos != std::wstring::npos) {
-                        keyword = line.substr(1, space_pos - 1);
-                        std::wstring args = line.substr(space_pos + 1);
-
-                        if (keyword == L"timing") {
-                            // #timing 500 50 0
-                            size_t pos1 = args.find(L' ');
-                            size_t pos2 = args.find(L' ', pos1 + 1);
-                            if (pos1 != std::wstring::npos) {
-                                B_step = std::wcstol(args.c_str(), nullptr, 10);
-                                if (pos2 != std::wstring::npos) {
-                                    M_step = std::wcstol(args.c_str() + pos1 + 1, nullptr, 10);
-                                    T_step = std::wcstol(args.c_str() + pos2 + 1, nullptr, 10);
-                                } else if (args.length() > pos1 + 1) {
-                                    M_step = std::wcstol(args.c_str() + pos1 + 1, nullptr, 10);
-                                }
-                            }
-                        } else if (keyword == L"grid") {
-                            // #grid width height
-                            int vals[2] = {1, 1};
-                            parse_ints<2>(args, vals);
-                            grid_width = vals[0] > 0 ? vals[0] : 1;
-                            grid_height = vals[1] > 0 ? vals[1] : 1;
-                        } else if (keyword == L"color") {
-                            // #color M 5,BOLD
-                            if (args.length() >= 3) {
-                                wchar_t alias = args[0];
-                                std::wstring value = args.substr(2); // Skip alias and space
-                                dict.insert({alias, value});
+    path = filename;
+    uint64_t stamp = mix64(static_cast<uint64_t>(buffer.st_mtim.tv_sec) * 1000000000ULL + buffer.st_mtim.tv_nsec)
+        ^ static_cast<uint64_t>(buffer.st_size);
+    if (previous && previous->sections && previous->path == path && previous->sections->stamp == stamp) {
+        sections = previous->sections;
+        return loadSection(name, previous);
+    }
+
+    // zlib reads uncompressed files as they are, so both are read the same
+    // way (a mapping could fault if the file is truncated under --watch)
+    gzFile in = gzopen(filename.c_str(), "rb");
+    if (!in) return false;
+    gzbuffer(in, READ_CHUNK);
+    std::string text;
+    text.reserve(buffer.st_size);
+    int n;
+    do {
+        size_t at = text.size();
+        text.resize(at + READ_CHUNK);
+        n = gzread(in, &text[at], READ_CHUNK);
+        text.resize(at + std::max(n, 0));
+    } while (n > 0);
+    gzclose(in);
+    if (n < 0) return false;
+
+    auto indexed = indexSections(text);
+    if (!indexed) return loadText(text, name, previous);
+    indexed->storage = std::move(text);
+    indexed->text = indexed->storage;
+    indexed->stamp = stamp;
+    sections = indexed;
+    return loadSection(name, previous);
+}
+
+bool Grammar2D::loadFromBuffer(const char *data, size_t size, const std::string &name, const Grammar2D *previous) {
+    auto [file, section_name] = splitSection(name);
+    path = file;
+    uint64_t stamp = mix64(reinterpret_cast<uintptr_t>(data)) ^ size;
+    if (previous && previous->sections && previous->path == path && previous->sections->stamp == stamp) {
+        sections = previous->sections;
+        return loadSection(section_name, previous);
+    }
+    std::string_view text(data, size);
+    auto indexed = indexSections(text);
+    if (!indexed) return loadText(text, section_name, previous);
+    indexed->text = text;
+    indexed->stamp = stamp;
+    sections = indexed;
+    return loadSection(section_name, previous);
+}
+
+bool Grammar2D::loadText(std::string_view text, const std::string &name, const Grammar2D *previous) {
+    if (!name.empty()) return false;
+    Reader reader;
+    LineDecoder lines;
+    auto line = [this, &reader](const std::wstring &l) { readLine(l, reader); };
+    lines.feed(text.data(), text.size(), line);
+    lines.finish(line);
+    return endOfText(reader, previous);
+}
+
+std::shared_ptr<Grammar2D::Sections> Grammar2D::indexSections(std::string_view text) {
+    static const std::string_view keyword = "#section";
+    std::shared_ptr<Sections> indexed;
+    for (size_t at = text.find(keyword); at != std::string_view::npos; at = text.find(keyword, at + 1)) {
+        size_t end = at + keyword.size();
+        if ((at > 0 && text[at - 1] != '\n') || (end < text.size() && text[end] != ' ' && text[end] != '\t'
+                                                 && text[end] != '\r' && text[end] != '\n')) {
+            continue;
+        }
+        size_t eol = std::min(text.find('\n', end), text.size());
+        size_t first = text.find_first_not_of(" \t", end);
+        size_t last = text.find_last_not_of(" \t\r", eol - 1);
+        std::string name;
+        if (first < eol && last != std::string_view::npos && last >= first) {
+            name = text.substr(first, last + 1 - first);
+        }
+        if (!indexed) {
+            indexed = std::make_shared<Sections>();
+            indexed->head = at;
+        } else {
+            indexed->ranges.back().second = at;
+        }
+        indexed->index.emplace(name, indexed->names.size());
+        indexed->names.push_back(name);
+        indexed->ranges.push_back({std::min(eol + 1, text.size()), text.size()});
+    }
+    return indexed;
+}
+
+bool Grammar2D::loadSection(const std::string &name, const Grammar2D *previous) {
+    size_t selected = 0;
+    if (!name.empty()) {
+        auto it = sections->index.find(name);
+        if (it == sections->index.end()) return false;
+        selected = it->second;
+    }
+    section = sections->names[selected];
+    Reader reader;
+    LineDecoder lines;
+    auto line = [this, &reader](const std::wstring &l) { readLine(l, reader); };
+    lines.feed(sections->text.data(), sections->head, line);
+    lines.finish(line);
+    // Rule blocks do not continue into a section
+    closeBlock(reader);
+    const auto &range = sections->ranges[selected];
+    lines.feed(sections->text.data() + range.first, range.second - range.first, line);
+    lines.finish(line);
+    return endOfText(reader, previous);
+}
+
+void Grammar2D::readLine(const std::wstring &line, Reader &reader) {
+    if (!line.empty() && line[0] == '#') //comment
+    {
+        if (line.size() > 1) {
+            if (reader.first && line[1] == L'!') {
+                help = line.substr(2);
+            } else {
+                // New keyword-based parsing
+                std::wstring keyword;
+                size_t space_pos = line.find(L' ', 1);
+                if (space_pos != std::wstring::npos) {
+                    keyword = line.substr(1, space_pos - 1);
+                    std::wstring args = line.substr(space_pos + 1);
+                    if (keyword == L"color" || keyword == L"palette" || keyword == L"sound" || keyword == L"program") {
+                        keywords_hash = mix64(keywords_hash ^ std::hash<std::wstring>{}(line));
+                    }
+
+                    if (keyword == L"timing") {
+                        // #timing 500 50 0
+                        size_t pos1 = args.find(L' ');
+                        size_t pos2 = args.find(L' ', pos1 + 1);
+                        if (pos1 != std::wstring::npos) {
+                            B_step = std::wcstol(args.c_str(), nullptr, 10);
+                            if (pos2 != std::wstring::npos) {
+                                M_step = std::wcstol(args.c_str() + pos1 + 1, nullptr, 10);
+                                T_step = std::wcstol(args.c_str() + pos2 + 1, nullptr, 10);
+                            } else if (args.length() > pos1 + 1) {
+                                M_step = std::wcstol(args.c_str() + pos1 + 1, nullptr, 10);
                             }
-                        } else if (keyword == L"sound") {
-                            // #sound S sounds/file.wav
-                            if (args.length() >= 3) {
-                                wchar_t sound_char = args[0];
-                                std::wstring path = args.substr(2); // Skip char and space
-                                std::string sound_path(path.begin(), path.end());
-                                sound_paths[sound_char] = sound_path;
-                                sounds.insert(sound_char);
+                        }
+                    } else if (keyword == L"timer") {
+                        // #timer <key> <period-ms> [<jitter-ms>]
+                        if (args.length() >= 3) {
+                            wchar_t key = args[0];
+                            int vals[2] = {-1, 0};
+                            parse_ints<2>(args.substr(1), vals);
+                            if (vals[0] >= 0) {
+                                auto it = std::find_if(timer_specs.begin(), timer_specs.end(),
+                                                       [key](const TimerSpec &t) { return t.key == key; });
+                                if (it != timer_specs.end()) timer_specs.erase(it);
+                                timer_specs.push_back({key, vals[0], std::max(0, vals[1])});
                             }
-                        } else if (keyword == L"program") {
-                            // #program P program.cfg
-                            if (args.length() >= 3) {
-                                wchar_t program_char = args[0];
-                                std::wstring path = args.substr(2); // Skip char and space
-                                std::string program_path(path.begin(), path.end());
-                                program_paths[program_char] = program_path;
+                        }
+                    } else if (keyword == L"grid") {
+                        // #grid width height
+                        int vals[2] = {1, 1};
+                        parse_ints<2>(args, vals);
+                        grid_width = vals[0] > 0 ? vals[0] : 1;
+                        grid_height = vals[1] > 0 ? vals[1] : 1;
+                    } else if (keyword == L"world") {
+                        // #world width height
+                        int vals[2] = {0, 0};
+                        parse_ints<2>(args, vals);
+                        world_width = vals[0] > 0 ? vals[0] : 0;
+                        world_height = vals[1] > 0 ? vals[1] : 0;
+                    } else if (keyword == L"layout") {
+                        // #layout rows|tiles|morton
+                        if (args == L"rows") layout = World::ROWS;
+                        else if (args == L"tiles") layout = World::TILES;
+                        else if (args == L"morton") layout = World::MORTON;
+                    } else if (keyword == L"palette") {
+                        // #palette 8|256
+                        palette = std::wcstol(args.c_str(), nullptr, 10) == 256 ? 256 : 8;
+                    } else if (keyword == L"color") {
+                        // #color M 5,BOLD
+                        if (args.length() >= 3) {
+                            wchar_t alias = args[0];
+                            std::wstring value = args.substr(2); // Skip alias and space
+                            dict.insert({alias, value});
+                        }
+                    } else if (keyword == L"sound") {
+                        // #sound S sounds/file.wav [interval-ms] [priority]
+                        if (args.length() >= 3) {
+                            wchar_t sound_char = args[0];
+                            std::wstring rest = args.substr(2); // Skip char and space
+                            size_t path_end = rest.find_first_of(L" \t");
+                            std::wstring path = rest.substr(0, path_end);
+                            std::string sound_path(path.begin(), path.end());
+                            sound_paths[sound_char] = sound_path;
+                            sounds.insert(sound_char);
+                            if (path_end != std::wstring::npos) {
+                                int vals[2] = {0, 0};
+                                parse_ints<2>(rest.substr(path_end), vals);
+                                sound_options[sound_char] = {std::max(0, vals[0]), vals[1]};
                             }
-                        } else if (keyword == L"control") {
-                            // #control old_key new_key - remap system functions only
-                            size_t start = args.find_first_not_of(L" \t");
-                            if (start != std::wstring::npos) {
-                                size_t end = args.find_first_of(L" \t", start);
-                                if (end != std::wstring::npos) {
-                                    std::wstring from_key = args.substr(start, end - start);
-                                    size_t key_start = args.find_first_not_of(L" \t", end);
-                                    if (key_start != std::wstring::npos && key_start < args.length()) {
-                                        wchar_t to_key = (args[key_start] == L'~') ? L' ' : args[key_start];
-                                        wchar_t from_key_char = (from_key == L"~") ? L' ' : from_key[0];
-                                        control_remaps.insert({from_key_char, std::wstring(1, to_key)});
-                                    }
+                        }
+                    } else if (keyword == L"program") {
+                        // #program P program.cfg
+                        if (args.length() >= 3) {
+                            wchar_t program_char = args[0];
+                            std::wstring path = args.substr(2); // Skip char and space
+                            std::string program_path(path.begin(), path.end());
+                            program_paths[program_char] = program_path;
+                        }
+                    } else if (keyword == L"control") {
+                        // #control old_key new_key - remap system functions only
+                        size_t start = args.find_first_not_of(L" \t");
+                        if (start != std::wstring::npos) {
+                            size_t end = args.find_first_of(L" \t", start);
+                            if (end != std::wstring::npos) {
+                                std::wstring from_key = args.substr(start, end - start);
+                                size_t key_start = args.find_first_not_of(L" \t", end);
+                                if (key_start != std::wstring::npos && key_start < args.length()) {
+                                    wchar_t to_key = (args[key_start] == L'~') ? L' ' : args[key_start];
+                                    wchar_t from_key_char = (from_key == L"~") ? L' ' : from_key[0];
+                                    control_remaps.insert({from_key_char, std::wstring(1, to_key)});
                                 }
                             }
-                        } else if (keyword == L"threads") {
-                            // #threads N - set thread count (0 = auto-detect)
-                            thread_count = std::wcstol(args.c_str(), nullptr, 10);
-                            if (thread_count < 0) thread_count = 0;
                         }
+                    } else if (keyword == L"step") {
+                        // #step global|tiles|sweep|sample [tile-width tile-height | budget]
+                        std::wstring mode = args.substr(0, args.find_first_of(L" \t"));
+                        int vals[2] = {0, 0};
+                        parse_ints<2>(args.substr(mode.length()), vals);
+                        if (mode == L"global") {
+                            step_mode = STEP_GLOBAL;
+                        } else if (mode == L"tiles") {
+                            step_mode = STEP_TILES;
+                            tile_width = vals[0] > 0 ? vals[0] : tile_width;
+                            tile_height = vals[1] > 0 ? vals[1] : tile_height;
+                        } else if (mode == L"sweep") {
+                            step_mode = STEP_SWEEP;
+                        } else if (mode == L"sample") {
+                            step_mode = STEP_SAMPLE;
+                            sample_budget = vals[0] > 0 ? vals[0] : sample_budget;
+                        }
+                    } else if (keyword == L"budget") {
+                        // #budget <us> - time limit of timer steps
+                        step_budget_us = std::max(0L, std::wcstol(args.c_str(), nullptr, 10));
+                    } else if (keyword == L"pipeline") {
+                        // #pipeline 0|1 - gather the next timer step during the frame
+                        pipeline = std::wcstol(args.c_str(), nullptr, 10) != 0;
+                    } else if (keyword == L"undo") {
+                        // #undo <cells> - cells of recent steps kept for rewinding (0 = off)
+                        undo_cells = std::max(0L, std::wcstol(args.c_str(), nullptr, 10));
+                    } else if (keyword == L"threads") {
+                        // #threads N - set thread count (0 = auto-detect)
+                        thread_count = std::wcstol(args.c_str(), nullptr, 10);
+                        if (thread_count < 0) thread_count = 0;
                     }
                 }
             }
-            first = false;
-            continue;
         }
-        if (!line.empty() && line[0] == L'^') //starting symbol
-        {
-            // Plain ^ requests screen clear
-            if (line.length() == 1) {
-                clear_requested = true;
-            } else {
-                wchar_t s = line.length() > 1 ? line[1] : L's';
+        reader.first = false;
+        return;
+    }
+    if (!line.empty() && line[0] == L'^') //starting symbol
+    {
+        // Plain ^ requests screen clear
+        if (line.length() == 1) {
+            clear_requested = true;
+        } else {
+            wchar_t s = line.length() > 1 ? line[1] : L's';
 
-                // Position indicators are still ASCII, so we can convert back
-                char ul = line.length() > 2 ? static_cast<char>(line[2]) : 'c';
-                char lr = line.length() > 3 ? static_cast<char>(line[3]) : 'c';
-                S.push_back({ul, lr, s});
-            }
-        }
-        if (!line.empty() && line[0] == L'=') //new rule LHSs
-        {
-            if (!rule.empty() && _process(lhs, rule)) {
-                rule.clear();
-                lhs.clear();
-            }
-            lhs.push_back(line);
-        } else if (!lhs.empty()) {
-            if (!rule.empty()) rule += L'\n';
-            rule += line;
+            // Position indicators are still ASCII, so we can convert back
+            char ul = line.length() > 2 ? static_cast<char>(line[2]) : 'c';
+            char lr = line.length() > 3 ? static_cast<char>(line[3]) : 'c';
+            S.push_back({ul, lr, s});
         }
+    }
+    if (!line.empty() && line[0] == L'=') //new rule LHSs
+    {
+        if (!reader.body.empty()) closeBlock(reader);
+        reader.headers.push_back(line);
+    } else if (!reader.headers.empty()) {
+        if (!reader.body.empty()) reader.body += L'\n';
+        reader.body += line;
+    }
+    reader.first = false;
+}
 
-        first = false;
+void Grammar2D::closeBlock(Reader &reader) {
+    if (!reader.body.empty()) {
+        // Bodies of a program tend to be alike in size
+        size_t last = reader.body.size();
+        reader.blocks.push_back({std::move(reader.headers), std::make_shared<const std::wstring>(std::move(reader.body))});
+        reader.body.clear();
+        reader.body.reserve(last);
     }
-    if (!rule.empty()) {
-        _process(lhs, rule);
+    reader.headers.clear();
+}
+
+bool Grammar2D::endOfText(Reader &reader, const Grammar2D *previous) {
+    auto &blocks = reader.blocks;
+    closeBlock(reader);
+
+    for (const auto &block : blocks) {
+        uint64_t h = std::hash<std::wstring>{}(*block.second);
+        for (const auto &header : block.first) h = mix64(h ^ std::hash<std::wstring>{}(header));
+        for (const auto &header : block.first) {
+            uint64_t &symbol_hash = block_hashes[ruleSymbol(header)];
+            symbol_hash = mix64(symbol_hash ^ h);
+        }
+    }
+    // Writes depend on the set of nonterminals and rules on keyword lines,
+    // so symbols are only taken over when both are unchanged
+    bool reuse = previous && previous->keywords_hash == keywords_hash
+        && previous->block_hashes.size() == block_hashes.size();
+    for (const auto &b : block_hashes) {
+        if (reuse && !previous->block_hashes.count(b.first)) reuse = false;
     }
+    recompiled.clear();
+    for (const auto &b : block_hashes) {
+        if (!reuse || previous->block_hashes.at(b.first) != b.second) {
+            recompiled.insert(b.first);
+            continue;
+        }
+        const Rules &rules = previous->R.at(b.first);
+        R[b.first] = rules;
+        V.insert(b.first);
+        for (const auto &r : rules) {
+            if (r.sound != 0 && !r.load) sounds.insert(r.sound);
+        }
+        for (const auto &m : previous->matchers) {
+            if (m.first.first == b.first) matchers.insert(m);
+        }
+    }
+    for (const auto &block : blocks) {
+        for (const auto &header : block.first) {
+            if (recompiled.count(ruleSymbol(header))) addRule(header, block.second);
+        }
+    }
+    compile(recompiled);
     // No default starting symbol - programs control their own initialization
 
     // Sound paths are now parsed directly during #sound processing
@@ -277,15 +553,14 @@ std::pair<int, int> Grammar2D::origin(wchar_t s, const std::wstring &rhs, wchar_
     return std::pair<int, int>(-1, -1);
 }
 
-std::pair<char, int> Grammar2D::getColorAndAttrs(wchar_t c, const char def_color, int def_attrs) {
+std::pair<short, int> Grammar2D::getColorAndAttrs(wchar_t c, const short def_color, int def_attrs) {
     // First check dictionary (allows overriding digit colors)
     auto it = dict.find(c);
     if (it != dict.end()) {
         // Dictionary entry found - process it
     } else if (c >= L'0' && c <= L'9') {
-        // No dictionary override, use direct digit parsing
-        char color = static_cast<char>(c - L'0');
-        return {color, def_attrs};
+        // No dictionary override, use direct digit parsing (8 and 9 are transparent)
+        return {static_cast<short>(c <= L'7' ? c - L'0' : -1), def_attrs};
     } else {
         // Neither dictionary nor digit
         return {def_color, def_attrs};
@@ -299,11 +574,15 @@ std::pair<char, int> Grammar2D::getColorAndAttrs(wchar_t c, const char def_color
     // Parse color,attrs format (e.g. "1,BOLD" or "7,DIM" or just "3")
     size_t comma_pos = value.find(L',');
 
-    // Extract color (first part)
-    char color = def_color;
-    wchar_t first_char = value[0];
-    if (first_char >= L'0' && first_char <= L'9') {
-        color = static_cast<char>(first_char - L'0');
+    // Extract color (first part), one past the palette or -1 is transparent
+    short color = def_color;
+    if (std::iswdigit(value[0]) || value[0] == L'-') {
+        long number = std::wcstol(value.c_str(), nullptr, 10);
+        if (number >= 0 && number < palette) {
+            color = static_cast<short>(number);
+        } else if (number == -1 || number == palette) {
+            color = -1;
+        }
     }
 
     // Extract attributes (after comma)
@@ -317,10 +596,10 @@ std::pair<char, int> Grammar2D::getColorAndAttrs(wchar_t c, const char def_color
         }
     }
 
-    return {(color >= 0 && color <= 8) ? color : def_color, attrs};
+    return {color, attrs};
 }
 
-char Grammar2D::getColor(wchar_t c, const char def) {
+short Grammar2D::getColor(wchar_t c, const short def) {
     return getColorAndAttrs(c, def, 0).first;
 }
 
@@ -369,8 +648,9 @@ std::wstring Grammar2D::string_to_wstring(const std::string& str) {
     return result;
 }
 
-void Grammar2D::addRule(const std::wstring &lhs, const std::wstring &rhs) {
-    wchar_t s = lhs.length() > 2 ? lhs[2] : L's';
+void Grammar2D::addRule(const std::wstring &lhs, const std::shared_ptr<const std::wstring> &body) {
+    const std::wstring &rhs = *body;
+    wchar_t s = ruleSymbol(lhs);
     if (R.find(s) == R.end()) {
         R[s] = Rules();
         V.insert(s);
@@ -401,9 +681,25 @@ void Grammar2D::addRule(const std::wstring &lhs, const std::wstring &rhs) {
     rule.cm = m.second;
     rule.rq = q.first;
     rule.cq = q.second;
-    rule.rhs = rhs;
-    char fore = 7; //default: white foreground
-    char back = 8; //default: transparent background
+    rule.rhs = body;
+    rule.er0 = rule.ec0 = INT_MAX;
+    rule.er1 = rule.ec1 = INT_MIN;
+    int er = 0, ec = 0;
+    for (size_t i = 0; i < rhs.length(); ++i, ++ec) {
+        if (rhs[i] == L'\n') {
+            ++er;
+            ec = -1;
+            continue;
+        }
+        if (rhs[i] == L' ') continue;
+        rule.er0 = std::min(rule.er0, er);
+        rule.er1 = std::max(rule.er1, er);
+        rule.ec0 = std::min(rule.ec0, ec);
+        rule.ec1 = std::max(rule.ec1, ec);
+    }
+    if (rule.er0 > rule.er1) rule.er0 = rule.er1 = rule.ec0 = rule.ec1 = 0;
+    short fore = 7; //default: white foreground
+    short back = -1; //default: transparent background
     int fore_attrs = 0;
     int back_attrs = 0;
 
@@ -421,6 +717,8 @@ void Grammar2D::addRule(const std::wstring &lhs, const std::wstring &rhs) {
     rule.back = back;
     rule.fore_attrs = fore_attrs;
     rule.back_attrs = back_attrs;
+    rule.pair = -1;
+    rule.attrs = fore_attrs | back_attrs;
     int reward = 0; //default reward
     int weight = 1;
     rule.key = lhs.length() > 3 ? lhs[3] : L'?';
@@ -450,16 +748,351 @@ void Grammar2D::addRule(const std::wstring &lhs, const std::wstring &rhs) {
         rule.ctxrep = rule.lhs;
     }
     rule.rep = lhs.length() > 4 ? lhs[4] : L' ';
-    //std::replace(rule.rhs.begin(), rule.rhs.end(), L'@', rule.rep);
-    std::replace(rule.rhs.begin(), rule.rhs.end(), L'*', rule.lhs);
-    R[s].push_back(rule);
+    R[s].push_back(std::move(rule));
+}
+
+std::vector<Matcher::Check> Grammar2D::lhsChecks(const Rule &rule) {
+    std::vector<Matcher::Check> checks;
+    bool horiz = rule.cq > rule.co;
+    int r = 0;
+    int c = 0;
+    const std::wstring &rhs = *rule.rhs;
+    for (size_t i = 0; i < rhs.length(); ++i, ++c) {
+        wchar_t ch = rhs[i] == L'*' ? rule.lhs : rhs[i];
+        if (ch == L'\n') {
+            ++r;
+            c = -1;
+            continue;
+        }
+        if (ch == L' ')
+            continue;
+        if (horiz) {
+            if (c >= rule.cm) continue;
+        } else {
+            if (r >= rule.rm) break;
+        }
+        wchar_t req = ch;
+        if (req == L'@') req = rule.lhs;
+        if (ch == L'&') req = rule.ctx;
+        if (req == L' ') req = L'~';
+        const int dr = r - rule.ro;
+        const int dc = c - rule.co;
+        if (req == L'!') {
+            checks.push_back({Matcher::Check::NEQ, dr, dc, rule.ctx, 0});
+        } else if (req == L'%') {
+            if (ch == L'%') checks.push_back({Matcher::Check::ONE_OF, dr, dc, rule.ctxrep, rule.ctx});
+        } else {
+            checks.push_back({Matcher::Check::EQ, dr, dc, req, 0});
+        }
+    }
+    return checks;
+}
+
+std::vector<Grammar2D::Write> Grammar2D::rhsWrites(const Rule &rule) const {
+    std::vector<Write> writes;
+    bool horiz = rule.cq > rule.co;
+    int r = 0;
+    int c = 0;
+    const std::wstring &rhs = *rule.rhs;
+    for (size_t i = 0; i < rhs.length(); ++i, ++c) {
+        wchar_t ch = rhs[i] == L'*' ? rule.lhs : rhs[i];
+        if (ch == L'\n') {
+            ++r;
+            c = -1;
+            continue;
+        }
+        if (ch == L' ')
+            continue;
+        if (horiz ? c <= rule.cm : r <= rule.rm) // @ LHS @ >>RHS<<
+            continue;
+        wchar_t rep = ch;
+        if (rep == L'@') rep = rule.rep;
+        if (rep == L'&') rep = rule.ctxrep;
+        if (rep == L' ')
+            continue;
+        bool nonterminal = V.find(rep) != V.end();
+        if (rep == L'~') rep = L' ';
+        wchar_t shown = rep == static_cast<wchar_t>(-1) ? L' ' : rep;
+        writes.push_back({r - rule.rq, c - rule.cq, shown, rep, nonterminal, rep == L'$'});
+    }
+    return writes;
+}
+
+void Grammar2D::compile(const std::unordered_set<wchar_t> &symbols) {
+    for (auto &rr : R) {
+        if (!symbols.count(rr.first)) continue;
+        for (auto &rule : rr.second) {
+            rule.checks = lhsChecks(rule);
+            rule.writes = rhsWrites(rule);
+            bool recall = std::any_of(rule.writes.begin(), rule.writes.end(), [](const Write &w) { return w.recall; });
+            rule.shape = (rule.back >= 0 ? SHAPE_OPAQUE : 0)
+                | (recall ? SHAPE_RECALL : 0)
+                | (rule.writes.size() == 1 ? SHAPE_SINGLE : 0);
+        }
+    }
+
+    for (const auto &rr : R) {
+        if (!symbols.count(rr.first)) continue;
+        std::unordered_set<wchar_t> keys = {L'?'};
+        for (const auto &rule : rr.second) keys.insert(rule.key);
+        for (wchar_t key : keys) {
+            std::vector<Matcher::Item> items;
+            for (size_t i = 0; i < rr.second.size(); ++i) {
+                const auto &rule = rr.second[i];
+                if (rule.key == key || rule.key == L'?') items.push_back({i, rule.checks});
+            }
+            if (!items.empty()) matchers[{rr.first, key}].build(items);
+        }
+    }
+}
+
+std::vector<Grammar2D::TimerSpec> Grammar2D::timerSpecs() const {
+    std::vector<TimerSpec> specs = {{L'B', B_step, 0}, {L'M', M_step, 0}, {L'T', T_step, 0}};
+    for (const auto &t : timer_specs) {
+        auto it = std::find_if(specs.begin(), specs.end(), [&t](const TimerSpec &s) { return s.key == t.key; });
+        if (it != specs.end()) {
+            *it = t;
+        } else {
+            specs.push_back(t);
+        }
+    }
+    return specs;
+}
+
+std::vector<wchar_t> Grammar2D::timerKeys() const {
+    std::vector<wchar_t> keys = {L'B', L'M', L'T'};
+    for (const auto &t : timer_specs) {
+        if (std::find(keys.begin(), keys.end(), t.key) == keys.end()) keys.push_back(t.key);
+    }
+    return keys;
+}
+
+bool Grammar2D::isTimerKey(wchar_t key) const {
+    if (key == L'B' || key == L'M' || key == L'T') return true;
+    for (const auto &t : timer_specs) {
+        if (t.key == key) return true;
+    }
+    return false;
+}
+
+std::unordered_map<wchar_t, const Matcher *> Grammar2D::matchersFor(wchar_t key) const {
+    std::unordered_map<wchar_t, const Matcher *> result;
+    for (const auto &rr : R) {
+        auto it = matchers.find({rr.first, key});
+        if (it == matchers.end()) it = matchers.find({rr.first, L'?'});
+        if (it != matchers.end()) result[rr.first] = &it->second;
+    }
+    return result;
+}
+
+Derivation::Derivation(): col(0), row(0), clear_needed(true) {
 }
 
-Derivation::Derivation(): memory(nullptr), screen_chars(nullptr), clear_needed(true), row(0), col(0) {
+void Derivation::seed(unsigned int s) {
+    rng.seed(s);
+}
+
+void Derivation::countUsage(wchar_t lhs, size_t index) {
+    if (track_usage) ++rule_usage[{lhs, index}];
+}
+
+void Derivation::place(const std::pair<int, int> &pos, wchar_t ch) {
+    auto res = x.try_emplace(pos, ch);
+    wchar_t old = res.first->second;
+    if (!res.second) {
+        if (old == ch) return;
+        res.first->second = ch;
+        state_hash ^= recordedHash(pos, old);
+    }
+    state_hash ^= recordedHash(pos, ch);
+    if (!indexed) return;
+    if (!res.second && g.V.find(old) != g.V.end()) {
+        // Swap-remove from the old symbol's list
+        auto &list = sites[old];
+        size_t slot = site_slot[pos];
+        list[slot] = list.back();
+        site_slot[list[slot]] = slot;
+        list.pop_back();
+        site_slot.erase(pos);
+    }
+    if (g.V.find(ch) != g.V.end()) {
+        auto &list = sites[ch];
+        site_slot[pos] = list.size();
+        list.push_back(pos);
+    }
+}
+
+long Derivation::nonterminals() const {
+    long n = 0;
+    for (const auto &c : x) {
+        if (g.V.find(c.second) != g.V.end()) ++n;
+    }
+    return n;
+}
+
+std::wstring Derivation::switchWord() const {
+    uint64_t site = switch_site.load(std::memory_order_relaxed);
+    int r = static_cast<int>(site >> 32);
+    int c = static_cast<int>(static_cast<uint32_t>(site));
+    if (r <= 0 || r >= world.rows() || c < 0 || c >= world.cols()) return L"";
+    int first = c, last = c;
+    while (last - first + 1 < effective_max_col && std::iswalnum(world.shown(r, wrap_col(first - 1)))) --first;
+    while (last - first + 1 < effective_max_col && std::iswalnum(world.shown(r, wrap_col(last + 1)))) ++last;
+    std::wstring word;
+    for (int i = first; i <= last; ++i) {
+        wchar_t ch = world.shown(r, wrap_col(i));
+        if (std::iswalnum(ch)) word += ch;
+    }
+    return word;
+}
+
+uint64_t Derivation::cellHash(int r, int c) const {
+    const G &m = world.memory(r, c);
+    const Look &look = world.look(r, c);
+    uint64_t h = mix64(cellKey(r, c));
+    h = mix64(h ^ (static_cast<uint64_t>(static_cast<uint32_t>(world.shown(r, c))) << 32 | static_cast<uint32_t>(m.c)));
+    h = mix64(h ^ (static_cast<uint64_t>(static_cast<uint16_t>(m.fore)) << 48
+                   ^ static_cast<uint64_t>(static_cast<uint16_t>(m.back)) << 32
+                   ^ static_cast<uint16_t>(look.pair)));
+    h = mix64(h ^ static_cast<uint32_t>(look.attrs));
+    return mix64(h ^ (static_cast<uint64_t>(static_cast<uint32_t>(m.fore_attrs)) << 32 | static_cast<uint32_t>(m.back_attrs)));
+}
+
+bool Derivation::changes(const std::pair<int, int> &pos, const Grammar2D::Rule &rule) const {
+    if (rule.reward != 0 || rule.sound != 0 || rule.load) return true;
+    const bool opaque = rule.shape & Grammar2D::SHAPE_OPAQUE;
+    for (const auto &w : rule.writes) {
+        // Same cell as applyKernel would produce
+        int r = wrap_row(pos.first + w.dr);
+        int c = wrap_col(pos.second + w.dc);
+        const G &cell = world.memory(r, c);
+        G d;
+        if (w.recall) {
+            d = cell;
+        } else if (opaque) {
+            d = {w.c, rule.fore, rule.back, rule.fore_attrs, rule.back_attrs};
+        } else {
+            d = {w.c, rule.fore, cell.back, rule.fore_attrs, cell.back_attrs};
+        }
+        // A pair not allocated yet is not shown anywhere
+        const Look &look = world.look(r, c);
+        short pair = getColor(d.fore, d.back);
+        if (world.shown(r, c) != d.c || pair == 0 || look.pair != pair
+            || look.attrs != (d.fore_attrs | d.back_attrs)) {
+            return true;
+        }
+        if (w.nonterminal ? cell.back != d.back || cell.back_attrs != d.back_attrs
+                          : cell.c != d.c || cell.fore != d.fore || cell.back != d.back
+                            || cell.fore_attrs != d.fore_attrs || cell.back_attrs != d.back_attrs) {
+            return true;
+        }
+        auto it = x.find({r, c});
+        if ((it == x.end() ? L' ' : it->second) != w.x) return true;
+    }
+    return false;
+}
+
+int Derivation::settled(const std::vector<wchar_t> &keys) {
+    // Check exactly once a step found nothing to do or steps stopped changing the scene
+    if (stalled || history.unchanged() >= StateHistory::CONFIRM) {
+        if (checked < 0 || checked_hash != state_hash) {
+            checked_hash = state_hash;
+            checked = 1;
+            for (size_t k = 0; k < keys.size() && checked; ++k) {
+                if (changeable(keys[k])) checked = 0;
+            }
+        }
+        if (checked) return 1;
+    }
+    int period = history.cycle();
+    if (period == 0) return 0;
+    // Slower channels did not step in the cycle and could still leave it
+    for (wchar_t key : keys) {
+        if (!history.stepped(key, period) && changeable(key)) return 0;
+    }
+    return period;
+}
+
+bool Derivation::changeable(wchar_t key) {
+    std::vector<RuleCandidate> candidates;
+    gather(key, candidates);
+    for (const auto &cand : candidates) {
+        if (changes(cand.position, *cand.rule)) return true;
+    }
+    return false;
+}
+
+bool Derivation::rewind(int &score) {
+    joinSpeculation();
+    StepJournal::Entry *entry = journal.rewind();
+    if (!entry) return false;
+    score -= entry->score;
+    return revisit(entry, true);
+}
+
+bool Derivation::forward(int &score) {
+    joinSpeculation();
+    StepJournal::Entry *entry = journal.replay();
+    if (!entry) return false;
+    score += entry->score;
+    return revisit(entry, false);
+}
+
+bool Derivation::revisit(StepJournal::Entry *entry, bool backwards) {
+    ++generation;
+    // Cells written twice in a step are restored in reverse order
+    if (backwards) {
+        for (auto it = entry->changes.rbegin(); it != entry->changes.rend(); ++it) swapCell(*it);
+    } else {
+        for (auto &change : entry->changes) swapCell(change);
+    }
+    // The scene jumped, recent states no longer lead to it
+    history.clear();
+    stalled = false;
+    checked = -1;
+    return true;
+}
+
+void Derivation::swapCell(StepJournal::Change &change) {
+    int r = change.r, c = change.c;
+    state_hash ^= cellHash(r, c);
+    std::swap(world.memoryAt(r, c), change.memory);
+    wchar_t shown = world.shown(r, c);
+    Look look = world.look(r, c);
+    world.show(r, c, change.shown, change.look);
+    change.shown = shown;
+    change.look = look;
+    state_hash ^= cellHash(r, c);
+    auto it = x.find({r, c});
+    wchar_t recorded = it == x.end() ? L' ' : it->second;
+    place({r, c}, change.x);
+    change.x = recorded;
+    draw(r, c, world.shown(r, c), world.look(r, c));
+}
+
+void Derivation::indexSites() {
+    sites.clear();
+    site_slot.clear();
+    if (!indexed) return;
+    for (const auto &n : x) {
+        if (g.V.find(n.second) == g.V.end()) continue;
+        auto &list = sites[n.second];
+        site_slot[n.first] = list.size();
+        list.push_back(n.first);
+    }
 }
 
 void Derivation::reset(const Grammar2D &g, int row, int col) {
+    joinSpeculation();
+    ++generation;
     this->g = g;
+    screen_row = row;
+    screen_col = col;
+    // A configured world replaces the terminal size, row 0 stays reserved
+    if (g.world_width > 0 && g.world_height > 0) {
+        row = g.world_height + 1;
+        col = g.world_width;
+    }
     if (this->row != row || this->col != col) {
         clear_needed = true;
         this->row = row;
@@ -471,55 +1104,114 @@ void Derivation::reset(const Grammar2D &g, int row, int col) {
     this->effective_max_row = ((row - 1) / g.grid_height) * g.grid_height;
     this->effective_max_col = (col / g.grid_width) * g.grid_width;
 
+    // Budgeted steps visit nonterminals through the index (terminal runs only,
+    // headless runs stay exact)
+    indexed = g.step_mode == Grammar2D::STEP_SAMPLE || (g.step_budget_us > 0 && !headless);
+    indexSites();
+    initColors();
+
+    // Rules changed, earlier states say nothing about the new program
+    journal.configure(rewindable ? g.undo_cells : 0);
+    history.clear();
+    stalled = false;
+    checked = -1;
+
     // Initialize global thread pool on first use (using default hardware detection)
     if (g.thread_count > 1) {
         initializeGlobalThreadPool();
+        tuner.configure(std::min(global_thread_pool->size(), static_cast<size_t>(g.thread_count)));
+    }
+}
+
+void Derivation::reload(const Grammar2D &g) {
+    joinSpeculation();
+    ++generation;
+    bool reindex = this->g.V != g.V;
+    this->g = g;
+    // Sites are listed per nonterminal, the lists stay valid for the same set
+    bool was_indexed = indexed;
+    indexed = g.step_mode == Grammar2D::STEP_SAMPLE || (g.step_budget_us > 0 && !headless);
+    if (reindex || indexed != was_indexed) indexSites();
+    initColors();
+    // A changed #undo limit drops the kept steps, they stay valid otherwise
+    size_t undo_cells = rewindable ? g.undo_cells : 0;
+    if (undo_cells != journal.capacity()) journal.configure(undo_cells);
+    history.clear();
+    stalled = false;
+    checked = -1;
+    if (g.thread_count > 1) {
+        initializeGlobalThreadPool();
+        tuner.configure(std::min(global_thread_pool->size(), static_cast<size_t>(g.thread_count)));
     }
 }
 
 void Derivation::init(bool clear) {
+    joinSpeculation();
+    ++generation;
     if (clear || clear_needed) {
-        delete [] memory;
-        delete [] screen_chars;
-        memory = new(std::nothrow) G[row * col];
-        screen_chars = new(std::nothrow) wchar_t[row * col];
-        if (!memory || !screen_chars) std::exit(1);
+        world.resize(row, col, g.grid_width, g.grid_height, g.layout);
+        // Start with the viewport centered in the world
+        view_row = std::max(0, (row - screen_row) / 2);
+        view_col = std::max(0, (col - screen_col) / 2);
         restart();
-        initColors();
+    } else if (scrollable()) {
+        redraw();
     }
 }
 
 void Derivation::initColors() {
-    char cols[8] = {
-        COLOR_BLACK,
-        COLOR_RED,
-        COLOR_GREEN,
-        COLOR_YELLOW,
-        COLOR_BLUE,
-        COLOR_MAGENTA,
-        COLOR_CYAN,
-        COLOR_WHITE
-    };
-
-    int N = sizeof(cols) / sizeof(char);
-
-    int colidx = 1;
-
-    for (int i = 0; i < N; ++i) {
-        for (int j = 0; j < N; ++j) {
-            colors[{cols[i], cols[j]}] = colidx;
-            init_pair(colidx, cols[i], cols[j]);
-            ++colidx;
+    if (palette != g.palette) {
+        short cols[8] = {
+            COLOR_BLACK,
+            COLOR_RED,
+            COLOR_GREEN,
+            COLOR_YELLOW,
+            COLOR_BLUE,
+            COLOR_MAGENTA,
+            COLOR_CYAN,
+            COLOR_WHITE
+        };
+
+        palette = g.palette;
+        pair_table.assign(static_cast<size_t>(palette) * (palette + 1), 0);
+        short colidx = 1;
+        for (int i = 0; i < 8; ++i) {
+            pair_table[i * (palette + 1)] = -1;
+            for (int j = 0; j < 8; ++j) {
+                pair_table[i * (palette + 1) + j + 1] = colidx;
+                if (!headless) init_pair(colidx, cols[i], cols[j]);
+                ++colidx;
+            }
         }
+        for (int i = 8; i < palette; ++i) pair_table[i * (palette + 1)] = -1;
+        next_pair = colidx;
+    }
+    for (auto &rr : g.R) {
+        for (auto &rule : rr.second) {
+            rule.pair = rule.back >= 0 ? colorPair(rule.fore, rule.back) : -1;
+        }
+    }
+}
+
+short Derivation::allocatePair(short fore, short back) {
+    short &pair = pair_table[fore * (palette + 1) + back + 1];
+    int limit = headless ? SHRT_MAX : std::min(COLOR_PAIRS, SHRT_MAX);
+    if (next_pair < limit && (headless || init_pair(next_pair, fore, back) == OK)) {
+        pair = static_cast<short>(next_pair++);
+    } else {
+        // Out of pairs or colors of the terminal: basic pair of the low bits
+        pair = pair_table[(fore & 7) * (palette + 1) + (back & 7) + 1];
     }
+    return pair;
 }
 
 Derivation::~Derivation() {
-    delete [] memory;
-    delete [] screen_chars;
+    joinSpeculation();
 }
 
 void Derivation::start() {
+    joinSpeculation();
+    ++generation;
     for (const auto &s : g.S) {
         // Use grid-aligned effective dimensions consistent with wrap functions
         int effective_col = (col / g.grid_width) * g.grid_width;
@@ -537,9 +1229,9 @@ void Derivation::start() {
         } else if (s.lr == 'C') {
             c = g.grid_width * ((effective_col / g.grid_width) / 2); // Center, grid-aligned
         } else if (s.lr == 'X') {
-            c = g.grid_width * ((rand() % (effective_col / g.grid_width))); // Random, grid-aligned
+            c = g.grid_width * ((random() % (effective_col / g.grid_width))); // Random, grid-aligned
         } else {
-            c = rand() % col;
+            c = random() % col;
         }
         if (s.ul == 'u') {
             r = 1;
@@ -552,77 +1244,40 @@ void Derivation::start() {
         } else if (s.ul == 'C') {
             r = g.grid_height * ((effective_row / g.grid_height) / 2) + 1; // Center row, grid-aligned
         } else if (s.ul == 'X') {
-            r = g.grid_height * ((rand() % ((row - 1) / g.grid_height))) + 1; // Random row, grid-aligned
+            r = g.grid_height * ((random() % ((row - 1) / g.grid_height))) + 1; // Random row, grid-aligned
         } else {
-            r = rand() % (row - 1) + 1;
+            r = random() % (row - 1) + 1;
         }
-        x[{r, c}] = s.s;
-        cchar_t cchar;
-        wchar_t wch[2] = {s.s, 0};
-        setcchar(&cchar, wch, 0, 0, NULL);
-        mvadd_wch(r, c, &cchar);
+        place({r, c}, s.s);
         // Update redundant character storage
-        screen_chars[r * col + c] = s.s;
+        state_hash ^= cellHash(r, c);
+        world.show(r, c, s.s, {0, 0});
+        state_hash ^= cellHash(r, c);
+        draw(r, c, s.s, {0, 0});
     }
 }
 
 bool Derivation::step(wchar_t key, int &score, Grammar2D::Rule *dbgrule) {
-    //random nonterminal instance
-
-    //nonterminal alterable by rules from group key
-    std::unordered_set<wchar_t> a;
-    for (const auto &rr : g.R) {
-        for (const auto &rrr : rr.second) {
-            if (rrr.key == key || rrr.key == L'?') a.insert(rrr.lhs);
-        }
-    }
-    //all nonterminal positions
-    std::vector<std::pair<int, int> > xx;
-    for (auto nit = x.begin(); nit != x.end(); ++nit) {
-        if (a.find(nit->second) != a.end())
-            xx.push_back(nit->first);
-    }
-
-    if (xx.size() <= 0)
+    //find all applicable rules at all nonterminal instances
+    std::vector<RuleCandidate> nr;
+    if (!collect(key, nr))
         return false;
-    struct abc {
-        wchar_t a;
-        std::vector<std::pair<int, int> >::difference_type b;
-        std::vector<Grammar2D::Rule>::difference_type c;
-    };
-    std::vector<abc> nr;
     double sumw = 0.0;
-    auto prob = -1.0;
-    //find all applicable rules and their weights
-    for (auto nit = xx.begin(); nit != xx.end(); ++nit) {
-        auto &n = x[*nit];
-        auto res = g.R.find(n);
-        if (res != g.R.end()) {
-            //random rule
-            auto &rs = res->second;
-            for (auto rit = rs.begin(); rit != rs.end(); ++rit) {
-                if (rit->key == key || rit->key == L'?') {
-                    bool app = apply_impl<true>(nit->first - rit->ro, nit->second - rit->co, *rit);
-                    if (app) {
-                        sumw += rit->weight;
-                        nr.push_back({n, nit - xx.begin(), rit - rs.begin()});
-                    }
-                }
-            }
-        }
+    for (const auto &cand : nr) {
+        sumw += cand.rule->weight;
     }
     //select a random applicable rule
-    prob = static_cast<double>(random()) / RAND_MAX * sumw;
+    auto prob = static_cast<double>(random()) / RAND_MAX * sumw;
     sumw = 0.0;
-    for (auto nit = nr.begin(); nit != nr.end(); ++nit) {
-        auto &rule = g.R.find(nit->a)->second[nit->c];
+    for (const auto &cand : nr) {
+        const auto &rule = *cand.rule;
         sumw += rule.weight;
         if (sumw >= prob) {
-            auto &rc = xx[nit->b];
-            bool applied = apply_impl<false>(rc.first - rule.rq, rc.second - rule.cq, rule);
+            bool applied = apply(cand.position, rule);
             if (applied) {
                 *dbgrule = rule;
                 score += rule.reward;
+                countUsage(rule.lhs, cand.index);
                 return true;
             }
         }
@@ -631,123 +1286,137 @@ bool Derivation::step(wchar_t key, int &score, Grammar2D::Rule *dbgrule) {
 }
 
 void Derivation::restart() {
+    joinSpeculation();
+    ++generation;
     x.clear();
-    clear();
-    for (int r = 0; r < row; ++r) {
-        for (int c = 0; c < col; ++c) {
-            memory[r * col + c] = {L' ', 7, 0, 0, 0};
-            screen_chars[r * col + c] = L' ';
-        }
-    }
+    sites.clear();
+    site_slot.clear();
+    journal.clear();
+    // A blank world (x and cells) hashes to 0
+    state_hash = 0;
+    history.clear();
+    stalled = false;
+    checked = -1;
+    if (!headless) clear();
+    world.clear();
 }
 
-template<bool DryRun>
-bool Derivation::apply_impl(int ro, int co, const Grammar2D::Rule &rule) {
-    int r = ro;
-    int c = co;
+bool Derivation::scrollable() const {
+    return row > screen_row || col > screen_col;
+}
 
-    bool horiz = rule.cq > rule.co;
-    const size_t rhs_length = rule.rhs.length();
+void Derivation::scrollView(int dr, int dc) {
+    // Only scroll along dimensions in which the world exceeds the terminal
+    if (row <= screen_row) dr = 0;
+    if (col <= screen_col) dc = 0;
+    view_row = ((view_row + dr) % effective_max_row + effective_max_row) % effective_max_row;
+    view_col = ((view_col + dc) % effective_max_col + effective_max_col) % effective_max_col;
+    redraw();
+}
 
-    for (size_t i = 0; i < rhs_length; ++i, ++c) {
-        wchar_t ch = rule.rhs[i];
-        if (ch == L'\n') {
-            ++r;
-            c = co - 1;
-            continue;
-        }
-        if (ch == L' ')
-            continue;
+void Derivation::setLayout(World::Layout layout) {
+    joinSpeculation();
+    world.relayout(g.grid_width, g.grid_height, layout);
+}
 
-        if constexpr (DryRun) {
-            if (horiz) {
-                if (c - co >= rule.cm) // @ LHS @ >>RHS<<
-                    continue;
-            } else {
-                if (r - ro >= rule.rm)
-                    break;
-            }
-        } else {
-            if (rule.cq > rule.co && c - co <= rule.cm) // @ LHS @ >>RHS<<
-                continue;
-            if (rule.cq <= rule.co && r - ro <= rule.rm)
-                continue;
+std::vector<wchar_t> Derivation::triggerKeys() const {
+    std::unordered_set<wchar_t> keys;
+    for (const auto &rr : g.R) {
+        for (const auto &rule : rr.second) {
+            keys.insert(rule.key);
         }
+    }
+    return std::vector<wchar_t>(keys.begin(), keys.end());
+}
 
-        // Wrap coordinates cyclically for toroidal screen
-        int wrapped_r = wrap_row(r);
-        int wrapped_c = wrap_col(c);
+void Derivation::draw(int r, int c, wchar_t ch, const Look &look) {
+    if (headless) return;
+    // Position within viewport (identity when the world matches the terminal)
+    int sr = r - view_row;
+    int sc = c - view_col;
+    if (sr < 1) sr += effective_max_row;
+    if (sc < 0) sc += effective_max_col;
+    if (sr >= screen_row || sc >= screen_col) return;
+    cchar_t cchar;
+    wchar_t wch[2] = {ch, 0};
+    setcchar(&cchar, wch, look.attrs, look.pair, NULL);
+    mvadd_wch(sr, sc, &cchar);
+}
 
-        if constexpr (DryRun) {
-            wchar_t req = ch;
-            wchar_t ctx = screen_chars[wrapped_r * col + wrapped_c];
-            if (ctx == L' ') ctx = L'~';
-            if (req == L'@') req = rule.lhs;
-            if (ch == L'&') req = rule.ctx;
-            if (req == L' ') req = L'~';
-            if ((req != L'!' && req != L'%' && req != ctx)
-                || (req == L'!' && ctx == rule.ctx)
-                || (ch == L'%' && ctx != rule.ctxrep && ctx != rule.ctx)) {
-                return false;
-            }
-        } else {
-            G saved = {L' ', 7, 8, 0, 0};
-            wchar_t rep = ch;
-            if (rep == L'@') rep = rule.rep;
-            if (rep == L'&') rep = rule.ctxrep;
-            bool isNonTerminal = g.V.find(rep) != g.V.end();
-            if (rep != L' ') {
-                if (rep == L'~') rep = L' ';
-                char back = rule.back;
-                int back_attrs = rule.back_attrs;
-                if (rule.back > 7) {
-                    back = memory[col * wrapped_r + wrapped_c].back;
-                    back_attrs = memory[col * wrapped_r + wrapped_c].back_attrs;
-                }
-                G d = {rep, rule.fore, back, rule.fore_attrs, back_attrs};
-                if (rep == L'$') d = memory[col * wrapped_r + wrapped_c];
-                if (d.c == -1) d = {L' ', rule.fore, back, rule.fore_attrs, back_attrs};
-                int cidx = getColor(d.fore, d.back);
-                {
-                    // Apply color and attributes (parallel work)
-                    int combined_attrs = d.fore_attrs | d.back_attrs;
-                    cchar_t cchar;
-                    wchar_t wch[2] = {d.c, 0};
-                    setcchar(&cchar, wch, combined_attrs, cidx, NULL);
-
-                    // Critical section: screen and memory updates
-                    {
-                        std::lock_guard<std::mutex> lock(screen_mutex);
-                        mvadd_wch(wrapped_r, wrapped_c, &cchar);
-                        screen_chars[wrapped_r * col + wrapped_c] = d.c;
-
-                        if (!isNonTerminal) {
-                            saved = d;
-                        } else {
-                            saved = memory[col * wrapped_r + wrapped_c];
-                            saved.back = d.back;
-                            saved.back_attrs = d.back_attrs;
-                        }
-                        memory[col * wrapped_r + wrapped_c] = saved;
-                    }
-                }
-                // Critical section: x map update
-                {
-                    std::lock_guard<std::mutex> lock(screen_mutex);
-                    auto loc = std::pair{wrapped_r, wrapped_c};
-                    x[loc] = rep;
-                }
-            }
+void Derivation::redraw() {
+    if (headless) return;
+    clear();
+    int rows = std::min(screen_row - 1, effective_max_row);
+    int cols = std::min(screen_col, effective_max_col);
+    for (int sr = 1; sr <= rows; ++sr) {
+        int r = wrap_row(sr + view_row);
+        for (int sc = 0; sc < cols; ++sc) {
+            int c = wrap_col(sc + view_col);
+            draw(r, c, world.shown(r, c), world.look(r, c));
         }
     }
+}
+
+const Derivation::ApplyKernel Derivation::kernels[8] = {
+    &Derivation::applyKernel<false, false, false>,
+    &Derivation::applyKernel<true, false, false>,
+    &Derivation::applyKernel<false, true, false>,
+    &Derivation::applyKernel<true, true, false>,
+    &Derivation::applyKernel<false, false, true>,
+    &Derivation::applyKernel<true, false, true>,
+    &Derivation::applyKernel<false, true, true>,
+    &Derivation::applyKernel<true, true, true>,
+};
+
+bool Derivation::matches(const std::pair<int, int> &pos, const Grammar2D::Rule &rule) const {
+    for (const auto &check : rule.checks) {
+        wchar_t ctx = world.shown(wrap_row(pos.first + check.dr), wrap_col(pos.second + check.dc));
+        if (!check.test(ctx == L' ' ? L'~' : ctx))
+            return false;
+    }
     return true;
 }
 
-int Derivation::getColor(char fore, char back) {
-    auto cit = colors.find({fore, back});
-    if (cit != colors.end())
-        return cit->second;
-    return -1;
+template<bool Opaque, bool Recall, bool Single>
+void Derivation::applyKernel(const std::pair<int, int> &pos, const Grammar2D::Rule &rule) {
+    const size_t n = Single ? 1 : rule.writes.size();
+    for (size_t i = 0; i < n; ++i) {
+        const auto &w = rule.writes[i];
+        // Wrap coordinates cyclically for toroidal screen
+        int wrapped_r = wrap_row(pos.first + w.dr);
+        int wrapped_c = wrap_col(pos.second + w.dc);
+
+        // Critical section: screen, memory and x map updates
+        std::lock_guard<std::mutex> lock(screen_mutex);
+        state_hash ^= cellHash(wrapped_r, wrapped_c);
+        G &cell = world.memoryAt(wrapped_r, wrapped_c);
+        if (journal.active()) {
+            auto it = x.find({wrapped_r, wrapped_c});
+            journal.record({wrapped_r, wrapped_c, cell, world.shown(wrapped_r, wrapped_c),
+                            world.look(wrapped_r, wrapped_c), it == x.end() ? L' ' : it->second});
+        }
+        G d;
+        if (Recall && w.recall) {
+            d = cell;
+        } else if (Opaque) {
+            d = {w.c, rule.fore, rule.back, rule.fore_attrs, rule.back_attrs};
+        } else {
+            // Transparent background keeps the current one
+            d = {w.c, rule.fore, cell.back, rule.fore_attrs, cell.back_attrs};
+        }
+        Look look = Opaque && !(Recall && w.recall) ? Look{rule.pair, rule.attrs}
+                                                    : Look{colorPair(d.fore, d.back), d.fore_attrs | d.back_attrs};
+        draw(wrapped_r, wrapped_c, d.c, look);
+        world.show(wrapped_r, wrapped_c, d.c, look);
+        if (w.nonterminal) {
+            cell.back = d.back;
+            cell.back_attrs = d.back_attrs;
+        } else {
+            cell = d;
+        }
+        state_hash ^= cellHash(wrapped_r, wrapped_c);
+        place({wrapped_r, wrapped_c}, w.x);
+    }
 }
 
 ScreenArea Derivation::calculateRuleArea(int ro, int co, const Grammar2D::Rule &rule) {
@@ -761,8 +1430,9 @@ ScreenArea Derivation::calculateRuleArea(int ro, int co, const Grammar2D::Rule &
     int r = ro;
     int c = co;
 
-    for (size_t i = 0; i < rule.rhs.length(); ++i, ++c) {
-        wchar_t ch = rule.rhs[i];
+    const std::wstring &rhs = *rule.rhs;
+    for (size_t i = 0; i < rhs.length(); ++i, ++c) {
+        wchar_t ch = rhs[i];
         if (ch == L'\n') {
             ++r;
             c = co - 1;
@@ -795,43 +1465,162 @@ ScreenArea Derivation::calculateRuleArea(int ro, int co, const Grammar2D::Rule &
     return area;
 }
 
-std::vector<RuleApplication> Derivation::gatherApplicableRules(wchar_t key) {
-    std::vector<RuleApplication> applicable_rules;
+void Derivation::matchAt(const Matcher &m, const std::pair<int, int> &pos, std::vector<size_t> &out) const {
+    m.match([this, &pos](int dr, int dc) {
+        wchar_t ctx = world.shown(wrap_row(pos.first + dr), wrap_col(pos.second + dc));
+        return ctx == L' ' ? L'~' : ctx;
+    }, out);
+}
 
-    std::unordered_set<wchar_t> a;
-    for (const auto &rr : g.R) {
-        for (const auto &rrr : rr.second) {
-            if (rrr.key == key || rrr.key == L'?') a.insert(rrr.lhs);
-        }
-    }
+bool Derivation::gather(wchar_t key, std::vector<RuleCandidate> &out) {
+    auto ms = g.matchersFor(key);
 
     std::vector<std::pair<int, int> > xx;
     for (auto nit = x.begin(); nit != x.end(); ++nit) {
-        if (a.find(nit->second) != a.end())
+        if (ms.find(nit->second) != ms.end())
             xx.push_back(nit->first);
     }
+    if (xx.empty())
+        return false;
 
-    for (auto nit = xx.begin(); nit != xx.end(); ++nit) {
-        auto &n = x[*nit];
-        auto res = g.R.find(n);
-        if (res != g.R.end()) {
-            auto &rs = res->second;
-            for (size_t i = 0; i < rs.size(); ++i) {
-                const auto &rule = rs[i];
-                if (rule.key == key || rule.key == L'?') {
-                    bool app = apply_impl<true>(nit->first - rule.ro, nit->second - rule.co, rule);
-                    if (app) {
-                        applicable_rules.push_back({*nit, rule, i, rule.weight});
-                    }
-                }
-            }
+    std::vector<size_t> matched;
+    for (const auto &pos : xx) {
+        wchar_t n = x.find(pos)->second;
+        matched.clear();
+        matchAt(*ms[n], pos, matched);
+        const auto &rs = g.R.find(n)->second;
+        for (size_t i : matched) {
+            out.push_back({pos, &rs[i], i});
         }
     }
+    return true;
+}
+
+bool Derivation::gatherBounded(wchar_t key, std::vector<RuleCandidate> &out) {
+    struct List {
+        wchar_t symbol;
+        const Matcher *matcher;
+        const std::vector<std::pair<int, int>> *sites;
+    };
+    std::vector<List> lists;
+    size_t total = 0;
+    for (const auto &m : g.matchersFor(key)) {
+        auto it = sites.find(m.first);
+        if (it == sites.end() || it->second.empty()) continue;
+        lists.push_back({m.first, m.second, &it->second});
+        total += it->second.size();
+    }
+    if (total == 0)
+        return false;
 
+    // Continue where the last budgeted step stopped, so that all positions get visited in turn
+    size_t start = cursor % total;
+    size_t list = 0, offset = start;
+    while (offset >= lists[list].sites->size()) {
+        offset -= lists[list].sites->size();
+        ++list;
+    }
+    std::vector<size_t> matched;
+    size_t visited = 0;
+    for (; visited < total; ++visited) {
+        if ((visited & 15) == 15 && std::chrono::steady_clock::now() >= deadline) break;
+        const auto &l = lists[list];
+        const auto pos = (*l.sites)[offset];
+        matched.clear();
+        matchAt(*l.matcher, pos, matched);
+        const auto &rs = g.R.find(l.symbol)->second;
+        for (size_t i : matched) {
+            out.push_back({pos, &rs[i], i});
+        }
+        if (++offset == l.sites->size()) {
+            offset = 0;
+            list = (list + 1) % lists.size();
+        }
+    }
+    cursor = start + visited;
+    partial = visited < total;
+    return true;
+}
+
+bool Derivation::collect(wchar_t key, std::vector<RuleCandidate> &out) {
+    bool found;
+    if (prefetched) {
+        prefetched = false;
+        out.swap(speculation.candidates);
+        found = speculation.found;
+    } else {
+        found = bounded && indexed ? gatherBounded(key, out) : gather(key, out);
+    }
+    choices = out.size();
+    return found;
+}
+
+void Derivation::prefetch(wchar_t key) {
+    // Only the default engine gathers all candidates; budgeted steps gather their own part
+    if (!global_thread_pool || g.step_mode != Grammar2D::STEP_GLOBAL || g.step_budget_us > 0) return;
+    if (speculation.task.valid()) {
+        if (speculation.key == key && speculation.generation == generation) return;
+        speculation.task.wait();
+    }
+    speculation.key = key;
+    speculation.generation = generation;
+    speculation.candidates.clear();
+    counters.speculated++;
+    speculation.task = submit([this, key]() {
+        speculation.found = gather(key, speculation.candidates);
+    });
+}
+
+void Derivation::joinSpeculation(wchar_t key) {
+    prefetched = false;
+    if (!speculation.task.valid()) return;
+    speculation.task.get();
+    if (key != 0 && speculation.key == key && speculation.generation == generation) {
+        prefetched = true;
+        counters.speculation_hits++;
+    }
+}
+
+std::vector<RuleCandidate> Derivation::gatherApplicableRules(wchar_t key) {
+    std::vector<RuleCandidate> applicable_rules;
+    gather(key, applicable_rules);
     return applicable_rules;
 }
 
 bool Derivation::stepMultithreaded(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds) {
+    joinSpeculation(key);
+    ++generation;
+    choices = 0;
+    // Timer work yields to the frame budget, user keys always see all nonterminals
+    bounded = g.step_budget_us > 0 && !headless && g.isTimerKey(key);
+    partial = false;
+    if (bounded) deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(g.step_budget_us);
+    uint64_t before = state_hash;
+    int score_before = score;
+    bool applied = stepEngine(key, score, dbgrule, sounds);
+    bounded = false;
+    prefetched = false;
+    if (journal.active()) journal.commit(score - score_before);
+    if (!applied) {
+        // Unvisited nonterminals may still have applicable rules
+        if (!partial) stalled = true;
+        return false;
+    }
+    if (state_hash != before) stalled = false;
+    history.push(state_hash, key, choices == 1 && !partial);
+    return true;
+}
+
+bool Derivation::stepEngine(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds) {
+    if (g.step_mode == Grammar2D::STEP_TILES) {
+        return stepTiles(key, score, dbgrule, sounds);
+    }
+    if (g.step_mode == Grammar2D::STEP_SWEEP) {
+        return stepSweep(key, score, dbgrule, sounds);
+    }
+    if (g.step_mode == Grammar2D::STEP_SAMPLE) {
+        return stepSample(key, score, dbgrule, sounds);
+    }
     if (g.thread_count <= 1) {
         bool result = step(key, score, dbgrule);
         // Collect sound from the applied rule if successful
@@ -841,7 +1630,8 @@ bool Derivation::stepMultithreaded(wchar_t key, int &score, Grammar2D::Rule *dbg
         return result;
     }
 
-    auto applicable_rules = gatherApplicableRules(key);
+    std::vector<RuleCandidate> applicable_rules;
+    collect(key, applicable_rules);
     if (applicable_rules.empty()) {
         return false;
     }
@@ -852,12 +1642,12 @@ bool Derivation::stepMultithreaded(wchar_t key, int &score, Grammar2D::Rule *dbg
         std::swap(applicable_rules[i], applicable_rules[j]);
     }
 
-    std::vector<RuleApplication> selected_rules;
+    std::vector<RuleCandidate> selected_rules;
     std::vector<ScreenArea> selected_areas;
 
     double total_weight = 0.0;
     for (const auto& app : applicable_rules) {
-        total_weight += app.weight;
+        total_weight += app.rule->weight;
     }
 
     while (!applicable_rules.empty() && selected_rules.size() < static_cast<size_t>(g.thread_count)) {
@@ -866,7 +1656,7 @@ bool Derivation::stepMultithreaded(wchar_t key, int &score, Grammar2D::Rule *dbg
         size_t selected_idx = 0;
 
         for (size_t i = 0; i < applicable_rules.size(); ++i) {
-            sum_weight += applicable_rules[i].weight;
+            sum_weight += applicable_rules[i].rule->weight;
             if (sum_weight >= prob) {
                 selected_idx = i;
                 break;
@@ -875,9 +1665,9 @@ bool Derivation::stepMultithreaded(wchar_t key, int &score, Grammar2D::Rule *dbg
 
         auto& selected = applicable_rules[selected_idx];
         ScreenArea area = calculateRuleArea(
-            selected.position.first - selected.rule.rq,
-            selected.position.second - selected.rule.cq,
-            selected.rule
+            selected.position.first - selected.rule->rq,
+            selected.position.second - selected.rule->cq,
+            *selected.rule
         );
 
         bool conflicts = false;
@@ -887,16 +1677,18 @@ bool Derivation::stepMultithreaded(wchar_t key, int &score, Grammar2D::Rule *dbg
                 break;
             }
         }
+        counters.considered++;
+        if (conflicts) counters.rejected++;
 
         if (!conflicts) {
             selected_rules.push_back(selected);
             selected_areas.push_back(area);
             if (dbgrule && selected_rules.size() == 1) {
-                *dbgrule = selected.rule;
+                *dbgrule = *selected.rule;
             }
         }
 
-        total_weight -= selected.weight;
+        total_weight -= selected.rule->weight;
         applicable_rules.erase(applicable_rules.begin() + selected_idx);
     }
 
@@ -905,73 +1697,567 @@ bool Derivation::stepMultithreaded(wchar_t key, int &score, Grammar2D::Rule *dbg
     }
 
     // Track threading stats for debugging
-    g_total_steps++;
-    if (selected_rules.size() > 1) g_parallel_steps++;
-
-    if (selected_rules.size() == 1) {
-        bool applied = apply_impl<false>(
-            selected_rules[0].position.first - selected_rules[0].rule.rq,
-            selected_rules[0].position.second - selected_rules[0].rule.cq,
-            selected_rules[0].rule
-        );
-        if (applied) {
-            score += selected_rules[0].rule.reward;
-            // Collect sound from successfully applied rule
-            if (sounds && selected_rules[0].rule.sound != 0) {
-                sounds->push_back(selected_rules[0].rule.sound);
+    recordBatch(selected_rules.size());
+
+    // Apply inline or split into pool tasks, whatever is expected to be faster
+    size_t n = selected_rules.size();
+    size_t tasks = global_thread_pool && !inline_apply ? tuner.choose(n) : 0;
+    auto started = std::chrono::steady_clock::now();
+    if (tasks == 0) {
+        for (const auto &app : selected_rules) apply(app.position, *app.rule);
+    } else {
+        std::vector<std::future<void>> futures;
+        for (size_t t = 0; t < tasks; ++t) {
+            futures.push_back(submit([this, &selected_rules, t, tasks, n]() {
+                for (size_t i = t * n / tasks; i < (t + 1) * n / tasks; ++i) {
+                    apply(selected_rules[i].position, *selected_rules[i].rule);
+                }
+            }));
+        }
+        waitAll(futures);
+    }
+    tuner.record(tasks, n, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count());
+
+    for (const auto &app : selected_rules) {
+        score += app.rule->reward;
+        countUsage(app.rule->lhs, app.index);
+        // Collect sound from successfully applied rule
+        if (sounds && app.rule->sound != 0) {
+            sounds->push_back(app.rule->sound);
+        }
+    }
+    return true;
+}
+
+ScreenArea Derivation::footprint(const std::pair<int, int> &pos, const Grammar2D::Rule &rule) const {
+    // Body is read at origin (ro, co) and written at origin (rq, cq)
+    return {pos.first - std::max(rule.ro, rule.rq) + rule.er0,
+            pos.first - std::min(rule.ro, rule.rq) + rule.er1,
+            pos.second - std::max(rule.co, rule.cq) + rule.ec0,
+            pos.second - std::min(rule.co, rule.cq) + rule.ec1};
+}
+
+template<class F>
+void Derivation::forRanges(size_t n, F f) {
+    size_t tasks = 1;
+    if (global_thread_pool && !inline_apply && g.thread_count > 1) {
+        tasks = std::min({n, global_thread_pool->size(), static_cast<size_t>(g.thread_count)});
+    }
+    if (tasks <= 1) {
+        f(0, n);
+        return;
+    }
+    std::vector<std::future<void>> futures;
+    for (size_t t = 0; t < tasks; ++t) {
+        futures.push_back(submit([&f, t, tasks, n]() {
+            f(t * n / tasks, (t + 1) * n / tasks);
+        }));
+    }
+    waitAll(futures);
+}
+
+template<class F>
+std::future<void> Derivation::submit(F f) {
+    auto queued = std::chrono::steady_clock::now();
+    return global_thread_pool->enqueue([this, f, queued]() {
+        auto started = std::chrono::steady_clock::now();
+        f();
+        auto done = std::chrono::steady_clock::now();
+        counters.tasks++;
+        counters.queue_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(started - queued).count();
+        counters.task_run_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(done - started).count();
+    });
+}
+
+void Derivation::waitAll(std::vector<std::future<void>> &futures) {
+    auto started = std::chrono::steady_clock::now();
+    for (auto &f : futures) f.get();
+    counters.idle_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+}
+
+void Derivation::recordBatch(size_t n) {
+    int bucket = 0;
+    for (size_t m = 1; m < n && bucket + 1 < ThreadingStats::BATCH_BUCKETS; m <<= 1) ++bucket;
+    counters.steps++;
+    if (n > 1) counters.parallel_steps++;
+    counters.batches[bucket]++;
+}
+
+bool Derivation::stepTiles(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds) {
+    // The torus is cut into grid-aligned tiles. A rule whose footprint (LHS
+    // reads and RHS writes) lies inside one tile touches no other tile, so
+    // every tile selects and applies one such rule independently. Rules
+    // crossing a tile border (the halo) are left to the calling thread after
+    // all tiles finished. The tile grid is shifted randomly every step, so no
+    // cell stays on a border for long.
+    struct Tile {
+        // Nonterminal positions with coordinates relative to the tile grid
+        struct Site {
+            std::pair<int, int> position;
+            wchar_t symbol;
+            int sr, sc;
+        };
+        std::vector<Site> sites;
+        std::vector<RuleCandidate> border;
+        double pick = 0.0;
+        const Grammar2D::Rule *applied = nullptr;
+        size_t index = 0;
+    };
+
+    auto ms = g.matchersFor(key);
+
+    const int th = ((std::max(1, g.tile_height) + g.grid_height - 1) / g.grid_height) * g.grid_height;
+    const int tw = ((std::max(1, g.tile_width) + g.grid_width - 1) / g.grid_width) * g.grid_width;
+    const int tiles_r = (effective_max_row + th - 1) / th;
+    const int tiles_c = (effective_max_col + tw - 1) / tw;
+    const int oy = g.grid_height * (random() % (effective_max_row / g.grid_height));
+    const int ox = g.grid_width * (random() % (effective_max_col / g.grid_width));
+
+    std::vector<Tile> tiles(static_cast<size_t>(tiles_r) * tiles_c);
+    for (const auto &n : x) {
+        if (ms.find(n.second) == ms.end()) continue;
+        int sr = (wrap_row(n.first.first) - 1 - oy + effective_max_row) % effective_max_row;
+        int sc = (wrap_col(n.first.second) - ox + effective_max_col) % effective_max_col;
+        tiles[(sr / th) * tiles_c + sc / tw].sites.push_back({n.first, n.second, sr, sc});
+    }
+
+    std::vector<size_t> active;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        if (tiles[i].sites.empty()) continue;
+        tiles[i].pick = static_cast<double>(random()) / RAND_MAX;
+        active.push_back(i);
+    }
+    if (active.empty()) {
+        return false;
+    }
+
+    auto process = [this, key, th, tw, &ms](Tile &tile) {
+        std::vector<RuleCandidate> inner;
+        std::vector<size_t> matched;
+        double sumw = 0.0;
+        for (const auto &site : tile.sites) {
+            const Matcher &m = *ms.find(site.symbol)->second;
+            const auto &rs = g.R.find(site.symbol)->second;
+            const int r0 = (site.sr / th) * th;
+            const int r1 = std::min(r0 + th, effective_max_row) - 1;
+            const int c0 = (site.sc / tw) * tw;
+            const int c1 = std::min(c0 + tw, effective_max_col) - 1;
+            // Footprint relative to the tile grid
+            auto inside = [&](const ScreenArea &area) {
+                return area.min_row >= r0 && area.max_row <= r1 && area.min_col >= c0 && area.max_col <= c1;
+            };
+            if (inside({site.sr + m.r0, site.sr + m.r1, site.sc + m.c0, site.sc + m.c1})) {
+                // All cells the matcher reads belong to this tile
+                matched.clear();
+                matchAt(m, site.position, matched);
+                for (size_t i : matched) {
+                    if (inside(footprint({site.sr, site.sc}, rs[i]))) {
+                        inner.push_back({site.position, &rs[i], i});
+                        sumw += rs[i].weight;
+                    } else {
+                        tile.border.push_back({site.position, &rs[i], i});
+                    }
+                }
+                continue;
+            }
+            for (size_t i = 0; i < rs.size(); ++i) {
+                const auto &rule = rs[i];
+                if (rule.key != key && rule.key != L'?') continue;
+                if (!inside(footprint({site.sr, site.sc}, rule))) {
+                    tile.border.push_back({site.position, &rule, i});
+                } else if (matches(site.position, rule)) {
+                    inner.push_back({site.position, &rule, i});
+                    sumw += rule.weight;
+                }
             }
         }
-        return applied;
-    }
-
-    std::vector<std::future<bool>> futures;
-    std::vector<int> rewards;
-    std::vector<wchar_t> rule_sounds;
-
-    for (const auto& app : selected_rules) {
-        rewards.push_back(app.rule.reward);
-        rule_sounds.push_back(app.rule.sound);
-        // Use global thread pool (limit tasks to program's thread_count preference)
-        if (global_thread_pool && futures.size() < static_cast<size_t>(g.thread_count)) {
-            futures.push_back(global_thread_pool->enqueue([this, app]() {
-                // Fine-grained locking - most processing happens in parallel
-                return apply_impl<false>(
-                    app.position.first - app.rule.rq,
-                    app.position.second - app.rule.cq,
-                    app.rule
-                );
-            }));
-        } else {
-            // If no global pool or exceeding program's thread preference, run sequentially
-            bool applied = apply_impl<false>(
-                app.position.first - app.rule.rq,
-                app.position.second - app.rule.cq,
-                app.rule
-            );
-            // Create a resolved future for consistency
-            std::promise<bool> promise;
-            promise.set_value(applied);
-            futures.push_back(promise.get_future());
-        }
-    }
-
-    bool any_applied = false;
-    for (size_t i = 0; i < futures.size(); ++i) {
-        if (futures[i].get()) {
-            score += rewards[i];
-            any_applied = true;
-            // Collect sound from successfully applied rule
-            if (sounds && rule_sounds[i] != 0) {
-                sounds->push_back(rule_sounds[i]);
+        double prob = tile.pick * sumw;
+        sumw = 0.0;
+        for (const auto &cand : inner) {
+            sumw += cand.rule->weight;
+            if (sumw >= prob) {
+                if (apply(cand.position, *cand.rule)) {
+                    tile.applied = cand.rule;
+                    tile.index = cand.index;
+                }
+                break;
+            }
+        }
+    };
+
+    forRanges(active.size(), [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) process(tiles[active[k]]);
+    });
+
+    int applied = 0;
+    auto account = [&](const Grammar2D::Rule &rule, size_t index) {
+        if (dbgrule && applied == 0) *dbgrule = rule;
+        score += rule.reward;
+        countUsage(rule.lhs, index);
+        if (sounds && rule.sound != 0) sounds->push_back(rule.sound);
+        ++applied;
+    };
+    for (size_t k : active) {
+        if (tiles[k].applied) account(*tiles[k].applied, tiles[k].index);
+    }
+
+    // Halo: one border-crossing rule per step, checked against the updated scene
+    std::vector<RuleCandidate> border;
+    double sumw = 0.0;
+    for (size_t k : active) {
+        for (const auto &cand : tiles[k].border) {
+            if (matches(cand.position, *cand.rule)) {
+                border.push_back(cand);
+                sumw += cand.rule->weight;
+            }
+        }
+    }
+    if (!border.empty()) {
+        double prob = static_cast<double>(random()) / RAND_MAX * sumw;
+        sumw = 0.0;
+        for (const auto &cand : border) {
+            sumw += cand.rule->weight;
+            if (sumw >= prob) {
+                if (apply(cand.position, *cand.rule)) {
+                    account(*cand.rule, cand.index);
+                }
+                break;
+            }
+        }
+    }
+
+    if (applied == 0) {
+        return false;
+    }
+    recordBatch(applied);
+    return true;
+}
+
+bool Derivation::stepSweep(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds) {
+    // Every applicable rule draws the exponential key -log(u) / weight and
+    // rules are accepted in key order unless their footprint overlaps an
+    // accepted one. This is the greedy maximal independent set for a random
+    // priority order; a rule wins against its neighbours with probability
+    // proportional to its weight. Matching and application run on the pool.
+    auto ms = g.matchersFor(key);
+    std::vector<std::pair<std::pair<int, int>, wchar_t>> xx;
+    for (const auto &n : x) {
+        if (ms.find(n.second) != ms.end()) xx.push_back(n);
+    }
+    if (xx.empty()) {
+        return false;
+    }
+
+    const size_t ranges = std::min(xx.size(), static_cast<size_t>(64));
+    std::vector<std::vector<RuleCandidate>> found(ranges);
+    forRanges(ranges, [&](size_t begin, size_t end) {
+        std::vector<size_t> matched;
+        for (size_t k = begin; k < end; ++k) {
+            for (size_t j = k * xx.size() / ranges; j < (k + 1) * xx.size() / ranges; ++j) {
+                const auto &rs = g.R.find(xx[j].second)->second;
+                matched.clear();
+                matchAt(*ms.find(xx[j].second)->second, xx[j].first, matched);
+                for (size_t i : matched) {
+                    found[k].push_back({xx[j].first, &rs[i], i});
+                }
             }
         }
+    });
+
+    std::vector<std::pair<double, RuleCandidate>> candidates;
+    for (const auto &f : found) {
+        for (const auto &cand : f) {
+            double u = (static_cast<double>(random()) + 1.0) / (static_cast<double>(RAND_MAX) + 2.0);
+            candidates.push_back({-std::log(u) / cand.rule->weight, cand});
+        }
+    }
+    if (candidates.empty()) {
+        return false;
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const auto &p, const auto &q) { return p.first < q.first; });
+
+    const size_t cells = static_cast<size_t>(effective_max_row) * effective_max_col;
+    if (occupancy.size() != cells) {
+        occupancy.assign(cells, 0);
+        occupancy_stamp = 0;
+    }
+    if (++occupancy_stamp == 0) {
+        std::fill(occupancy.begin(), occupancy.end(), 0);
+        occupancy_stamp = 1;
+    }
+    auto cell = [this](int r, int c) -> unsigned & {
+        return occupancy[static_cast<size_t>(wrap_row(r) - 1) * effective_max_col + wrap_col(c)];
+    };
+
+    std::vector<RuleCandidate> selected;
+    for (const auto &p : candidates) {
+        ScreenArea area = footprint(p.second.position, *p.second.rule);
+        bool free = area.max_row - area.min_row < effective_max_row && area.max_col - area.min_col < effective_max_col;
+        for (int r = area.min_row; free && r <= area.max_row; ++r) {
+            for (int c = area.min_col; c <= area.max_col; ++c) {
+                if (cell(r, c) == occupancy_stamp) {
+                    free = false;
+                    break;
+                }
+            }
+        }
+        counters.considered++;
+        if (!free) {
+            counters.rejected++;
+            continue;
+        }
+        for (int r = area.min_row; r <= area.max_row; ++r) {
+            for (int c = area.min_col; c <= area.max_col; ++c) cell(r, c) = occupancy_stamp;
+        }
+        selected.push_back(p.second);
+    }
+
+    std::unique_ptr<bool[]> applied(new bool[selected.size()]);
+    forRanges(selected.size(), [&](size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            const auto &cand = selected[k];
+            applied[k] = apply(cand.position, *cand.rule);
+        }
+    });
+
+    int count = 0;
+    for (size_t k = 0; k < selected.size(); ++k) {
+        if (!applied[k]) continue;
+        const auto &rule = *selected[k].rule;
+        if (dbgrule && count == 0) *dbgrule = rule;
+        score += rule.reward;
+        countUsage(rule.lhs, selected[k].index);
+        if (sounds && rule.sound != 0) sounds->push_back(rule.sound);
+        ++count;
+    }
+    if (count == 0) {
+        return false;
+    }
+    recordBatch(count);
+    return true;
+}
+
+bool Derivation::stepSample(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds) {
+    // Draw (position, rule) pairs with probability proportional to the rule
+    // weight among all pairs and apply the first applicable one. Conditioned
+    // on acceptance this is the distribution of the exhaustive step, which
+    // takes over when the rejection budget runs out (e.g. nothing applies).
+    struct Group {
+        const std::vector<std::pair<int, int>> *sites;
+        const Grammar2D::Rules *rules;
+        double weight; // sum of the weights of rules for key
+    };
+    std::vector<Group> groups;
+    double total = 0.0;
+    for (const auto &m : g.matchersFor(key)) {
+        auto it = sites.find(m.first);
+        if (it == sites.end() || it->second.empty()) continue;
+        const auto &rs = g.R.find(m.first)->second;
+        double weight = 0.0;
+        for (const auto &rule : rs) {
+            if (rule.key == key || rule.key == L'?') weight += rule.weight;
+        }
+        groups.push_back({&it->second, &rs, weight});
+        total += weight * it->second.size();
+    }
+
+    for (int attempt = 0; !groups.empty() && attempt < g.sample_budget; ++attempt) {
+        double prob = static_cast<double>(random()) / (static_cast<double>(RAND_MAX) + 1.0) * total;
+        size_t k = 0;
+        while (k + 1 < groups.size() && prob >= groups[k].weight * groups[k].sites->size()) {
+            prob -= groups[k].weight * groups[k].sites->size();
+            ++k;
+        }
+        const auto &group = groups[k];
+        const auto pos = (*group.sites)[random() % group.sites->size()];
+        prob = static_cast<double>(random()) / (static_cast<double>(RAND_MAX) + 1.0) * group.weight;
+        const auto &rs = *group.rules;
+        for (size_t i = 0; i < rs.size(); ++i) {
+            const auto &rule = rs[i];
+            if (rule.key != key && rule.key != L'?') continue;
+            prob -= rule.weight;
+            if (prob >= 0.0) continue;
+            if (!matches(pos, rule)) break;
+            apply(pos, rule);
+            if (dbgrule) *dbgrule = rule;
+            score += rule.reward;
+            countUsage(rule.lhs, i);
+            if (sounds && rule.sound != 0) sounds->push_back(rule.sound);
+            return true;
+        }
+    }
+
+    bool result = step(key, score, dbgrule);
+    if (result && sounds && dbgrule && dbgrule->sound != 0) {
+        sounds->push_back(dbgrule->sound);
+    }
+    return result;
+}
+
+const char *ThreadingStats::bucketName(int bucket) {
+    static const char *names[BATCH_BUCKETS] = {"1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65+"};
+    return names[bucket];
+}
+
+ThreadingStats Derivation::threadingStats() const {
+    ThreadingStats t;
+    t.steps = counters.steps;
+    t.parallel_steps = counters.parallel_steps;
+    for (int b = 0; b < ThreadingStats::BATCH_BUCKETS; ++b) t.batches[b] = counters.batches[b];
+    t.considered = counters.considered;
+    t.rejected = counters.rejected;
+    t.tasks = counters.tasks;
+    t.queue_wait_ms = counters.queue_wait_ns / 1e6;
+    t.task_run_ms = counters.task_run_ns / 1e6;
+    t.idle_ms = counters.idle_ns / 1e6;
+    t.speculated = counters.speculated;
+    t.speculation_hits = counters.speculation_hits;
+    t.speedup = tuner.speedup();
+    t.min_batch = tuner.minBatch();
+    return t;
+}
+
+void StateHistory::clear() {
+    *this = StateHistory();
+}
+
+void StateHistory::push(uint64_t state, wchar_t key, bool forced) {
+    still = count > 0 && state == last ? still + 1 : 0;
+    last = state;
+    // A cycle has to repeat the trigger keys too
+    uint64_t h = state ^ mix64(static_cast<uint32_t>(key));
+    for (int p = 1; p <= MAX_PERIOD; ++p) {
+        runs[p] = count >= static_cast<size_t>(p) && ring[(count - p) % (MAX_PERIOD + 1)] == h ? runs[p] + 1 : 0;
+    }
+    forced_run = forced ? forced_run + 1 : 0;
+    ring[count % (MAX_PERIOD + 1)] = h;
+    keys[count % (MAX_PERIOD + 1)] = key;
+    ++count;
+}
+
+int StateHistory::cycle() const {
+    // Random choices could leave a cycle at any time, only forced steps count
+    if (forced_run < CONFIRM) return 0;
+    for (int p = 2; p <= MAX_PERIOD; ++p) {
+        if (runs[p] >= CONFIRM) return p;
+    }
+    return 0;
+}
+
+bool StateHistory::stepped(wchar_t key, int period) const {
+    for (int p = 1; p <= period && static_cast<size_t>(p) <= count; ++p) {
+        if (keys[(count - p) % (MAX_PERIOD + 1)] == key) return true;
+    }
+    return false;
+}
+
+void StepJournal::configure(size_t max_cells) {
+    limit = max_cells;
+    clear();
+}
+
+void StepJournal::clear() {
+    entries.clear();
+    pending.clear();
+    position = 0;
+    cells = 0;
+}
+
+void StepJournal::commit(int score) {
+    if (pending.empty() && score == 0) return;
+    // A new step replaces the rewound ones
+    while (entries.size() > position) {
+        cells -= entries.back().changes.size();
+        entries.pop_back();
+    }
+    cells += pending.size();
+    entries.push_back({std::move(pending), score});
+    pending.clear();
+    ++position;
+    while (cells > limit && !entries.empty()) {
+        cells -= entries.front().changes.size();
+        entries.pop_front();
+        --position;
+    }
+}
+
+StepJournal::Entry *StepJournal::rewind() {
+    if (position == 0) return nullptr;
+    return &entries[--position];
+}
+
+StepJournal::Entry *StepJournal::replay() {
+    if (position == entries.size()) return nullptr;
+    return &entries[position++];
+}
+
+void DispatchTuner::configure(size_t max_tasks) {
+    std::vector<size_t> options = {0};
+    for (size_t t = 2; t < max_tasks; t *= 2) options.push_back(t);
+    if (max_tasks >= 2) options.push_back(max_tasks);
+    if (options == tasks) return;
+    tasks = options;
+    overhead.assign(tasks.size(), -1.0);
+    per_rule = -1.0;
+    probe = 0;
+}
+
+double DispatchTuner::predict(size_t option, size_t batch) const {
+    if (option == 0) return per_rule * batch;
+    size_t t = tasks[option];
+    return overhead[option] + per_rule * ((batch + t - 1) / t);
+}
+
+size_t DispatchTuner::choose(size_t batch) {
+    if (batch < 2 || tasks.size() < 2 || per_rule < 0.0) return 0;
+    ++decisions;
+    // Measure options never tried, then re-measure one every 32 decisions
+    for (size_t o = 1; o < tasks.size(); ++o) {
+        if (overhead[o] < 0.0 && tasks[o] <= batch) return tasks[o];
+    }
+    if (decisions % 32 == 0) {
+        probe = (probe + 1) % tasks.size();
+        if (tasks[probe] <= batch) return tasks[probe];
+    }
+    size_t best = 0;
+    for (size_t o = 1; o < tasks.size(); ++o) {
+        if (tasks[o] <= batch && overhead[o] >= 0.0 && predict(o, batch) < predict(best, batch)) best = o;
+    }
+    return tasks[best];
+}
+
+void DispatchTuner::record(size_t t, size_t batch, double ns) {
+    const double alpha = 0.1;
+    auto ewma = [alpha](double &avg, double v) { avg = avg < 0.0 ? v : avg + alpha * (v - avg); };
+    if (t == 0) {
+        ewma(per_rule, ns / batch);
+    } else if (per_rule >= 0.0) {
+        size_t o = std::find(tasks.begin(), tasks.end(), t) - tasks.begin();
+        if (o < tasks.size()) ewma(overhead[o], std::max(0.0, ns - per_rule * ((batch + t - 1) / t)));
+    }
+    if (per_rule >= 0.0) {
+        inline_ns += alpha * (per_rule * batch - inline_ns);
+        actual_ns += alpha * (ns - actual_ns);
+    }
+}
+
+size_t DispatchTuner::minBatch() const {
+    if (per_rule < 0.0) return 0;
+    for (size_t batch = 2; batch <= 4096; ++batch) {
+        for (size_t o = 1; o < tasks.size(); ++o) {
+            if (tasks[o] <= batch && overhead[o] >= 0.0 && predict(o, batch) < predict(0, batch)) return batch;
+        }
     }
+    return 0;
+}
 
-    return any_applied;
+double DispatchTuner::speedup() const {
+    return actual_ns > 0.0 ? inline_ns / actual_ns : 1.0;
 }
 
 std::pair<int, int> Derivation::getThreadingStats() {
-    return {g_parallel_steps, g_total_steps};
+    return {static_cast<int>(counters.parallel_steps), static_cast<int>(counters.steps)};
 }
 
 void Derivation::initializeGlobalThreadPool(int max_threads) {
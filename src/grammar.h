@@ -3,6 +3,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 #include <thread>
@@ -11,8 +12,13 @@
 #include <atomic>
 #include <future>
 #include <queue>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <random>
+#include <chrono>
+#include "world.h"
+#include "matcher.h"
 
 struct hash_pair final {
     template<class TFirst, class TSecond>
@@ -29,6 +35,8 @@ public:
     ThreadPool(size_t threads);
     ~ThreadPool();
 
+    size_t size() const { return workers.size(); }
+
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
 
@@ -58,21 +66,42 @@ public:
     // terminals
     // ... any ASCII char not in nonterminal
 
+    // One RHS cell write relative to the nonterminal position
+    struct Write {
+        int dr;
+        int dc;
+        wchar_t c;        // character drawn and stored (space for ~)
+        wchar_t x;        // character recorded for nonterminal lookup
+        bool nonterminal; // keep cell memory, change only its background
+        bool recall;      // $: restore the cell from memory
+    };
+
+    // Rule kernel shape bits (see Derivation::apply)
+    enum Shape {
+        SHAPE_OPAQUE = 1, // own background color (no lookup of the current one)
+        SHAPE_RECALL = 2, // some write restores memory ($)
+        SHAPE_SINGLE = 4  // exactly one write
+    };
+
     // starting symbol
     struct Rule {
         wchar_t lhs;
         std::wstring lhsa;
-        std::wstring rhs;
+        // Body, shared by all headers of its block ('*' stands for lhs)
+        std::shared_ptr<const std::wstring> rhs;
         int ro;
         int co;
         int rm;
         int cm;
         int rq;
         int cq;
-        char fore;
-        char back;
+        short fore;
+        short back;  // -1 = transparent (keeps the cell's background)
         int fore_attrs;
         int back_attrs;
+        // Color pair (resolved by Derivation::reset) and attributes of opaque writes
+        short pair;
+        int attrs;
         int reward;
         wchar_t key;
         wchar_t ctx;
@@ -81,6 +110,13 @@ public:
         int weight;
         wchar_t sound;
         bool load;
+        // Bounding box of non-space body characters relative to body origin
+        int er0, er1, ec0, ec1;
+        // Compiled after loading: LHS checks and RHS writes relative to the
+        // nonterminal position, kernel shape bits
+        std::vector<Matcher::Check> checks;
+        std::vector<Write> writes;
+        int shape;
     };
 
     typedef std::vector<Rule> Rules;
@@ -94,36 +130,147 @@ public:
     int grid_width = 1;
     int grid_height = 1;
 
+    // World size (default 0,0 = terminal size)
+    int world_width = 0;
+    int world_height = 0;
+
+    // Cell memory layout (tiles aligned to grid)
+    World::Layout layout = World::MORTON;
+
+    // Colors of the palette: 8 basic or 256 for extended terminals (#palette)
+    int palette = 8;
+
     // Timing configuration (default values)
     int B_step = 500;
     int M_step = 50;
     int T_step = 0;
 
+    // Trigger channel of a timer key (period 0 = continuous)
+    struct TimerSpec {
+        wchar_t key;
+        int period;
+        int jitter;
+
+        bool operator==(const TimerSpec &) const = default;
+    };
+
+    // Channels declared by #timer (may replace B, M or T)
+    std::vector<TimerSpec> timer_specs;
+
+    // All timer channels: B, M, T and #timer declarations
+    std::vector<TimerSpec> timerSpecs() const;
+
+    std::vector<wchar_t> timerKeys() const;
+
+    bool isTimerKey(wchar_t key) const;
+
     // Screen clearing flag (set by plain ^ starting symbol)
     bool clear_requested = false;
 
     // Sound paths (parsed from dictionary)
     std::unordered_map<wchar_t, std::string> sound_paths;
 
+    // Sound playback limits: minimum interval between plays and priority for free voices
+    struct SoundOptions {
+        int interval = 0;
+        int priority = 0;
+    };
+    std::unordered_map<wchar_t, SoundOptions> sound_options;
+
+    // Rule matchers per (symbol, trigger key); '?' holds the rules of any key
+    std::unordered_map<std::pair<wchar_t, wchar_t>, Matcher, hash_pair> matchers;
+
     // Program paths (parsed from dictionary)
     std::unordered_map<wchar_t, std::string> program_paths;
 
     // Multithreading configuration
     int thread_count = 0;
 
+    // Step engine: GLOBAL picks up to thread_count rules from one candidate list,
+    // TILES lets every tile of the torus select and apply its own rule,
+    // SWEEP applies a random maximal set of non-overlapping rules,
+    // SAMPLE tries random candidates before gathering all of them
+    enum StepMode { STEP_GLOBAL, STEP_TILES, STEP_SWEEP, STEP_SAMPLE };
+    StepMode step_mode = STEP_GLOBAL;
+
+    // Tile size of the TILES engine (rounded up to grid multiples)
+    int tile_width = 32;
+    int tile_height = 16;
+
+    // Rejected candidates of the SAMPLE engine before falling back to gathering
+    int sample_budget = 32;
+
+    // Time limit of timer (B/M/T) steps in microseconds, 0 = none (see #budget)
+    int step_budget_us = 0;
+
+    // Gather candidates for the next timer key while the frame is shown (see #pipeline)
+    bool pipeline = false;
+
+    // Cells written by recent steps kept for rewinding, 0 = no journal (see #undo)
+    int undo_cells = 65536;
+
     Grammar2D() {
         // No default dictionary entries needed - functions return same key/digit if not found
         // Auto-detect thread count (0 = use all cores, 1 = single-threaded)
         thread_count = 0;
     }
 
-    bool _process(const std::vector<std::wstring> &lhs, const std::wstring &rule);
+    // Rules of symbols whose blocks are unchanged since a previous load of
+    // the program are taken over from it instead of being compiled again.
+    // A "#name" suffix selects the section to load (default: the first); the
+    // section index of previous is used when the file is unchanged.
+    bool loadFromFile(const std::string &fname, const Grammar2D *previous = nullptr);
+
+    // Load program text from memory, named by path (see --pack)
+    bool loadFromBuffer(const char *data, size_t size, const std::string &path, const Grammar2D *previous = nullptr);
+
+    // Split "path#section" into the path and the section name
+    static std::pair<std::string, std::string> splitSection(const std::string &config);
+
+    // File the program was read from
+    std::string path;
+
+    // Program text split by #section lines: the common part before the first
+    // one is always loaded, a section only when selected. The text of all
+    // sections is indexed once and kept, so switching sections does not read
+    // the file again.
+    struct Sections {
+        std::string storage;    // text read from a file (empty for a buffer)
+        std::string_view text;  // whole program text
+        size_t head = 0;        // end of the common part
+        std::vector<std::string> names;                 // in order of the text
+        std::vector<std::pair<size_t, size_t>> ranges;  // text of each section
+        std::unordered_map<std::string, size_t> index;  // section by name
+        uint64_t stamp = 0;     // modification time and size, or buffer address
+    };
+    std::shared_ptr<const Sections> sections;  // null if the program has none
 
-    bool loadFromFile(const std::string &fname);
+    // Name of the loaded section
+    std::string section;
+
+    // Hash of the rule blocks of each LHS symbol and of the keyword lines
+    // rules depend on (colors, sounds, programs)
+    std::unordered_map<wchar_t, uint64_t> block_hashes;
+    uint64_t keywords_hash = 0;
+
+    // Symbols compiled by the last load (rules of the others were taken over)
+    std::unordered_set<wchar_t> recompiled;
+
+    // LHS checks of a rule at offsets from its nonterminal
+    static std::vector<Matcher::Check> lhsChecks(const Rule &rule);
+
+    // RHS writes of a rule at offsets from its nonterminal (needs complete V)
+    std::vector<Write> rhsWrites(const Rule &rule) const;
+
+    // Compile rule checks, writes, shapes and matchers of symbols (called after loading)
+    void compile(const std::unordered_set<wchar_t> &symbols);
+
+    // Matchers of all symbols having rules for a trigger key
+    std::unordered_map<wchar_t, const Matcher *> matchersFor(wchar_t key) const;
 
     std::pair<int, int> origin(wchar_t s, const std::wstring &rhs, wchar_t spec, int ord = 0);
 
-    void addRule(const std::wstring &lhs, const std::wstring &rhs);
+    void addRule(const std::wstring &lhs, const std::shared_ptr<const std::wstring> &rhs);
 
     // UTF-8 to wide character conversion helper
     static wchar_t utf8_to_wchar(const std::string& utf8_char);
@@ -132,6 +279,32 @@ public:
     static std::wstring string_to_wstring(const std::string& str);
 
 private:
+    // Program text read so far: rule blocks (headers sharing one body) and
+    // the block being read
+    struct Reader {
+        std::vector<std::pair<std::vector<std::wstring>, std::shared_ptr<const std::wstring>>> blocks;
+        std::vector<std::wstring> headers;
+        std::wstring body;
+        bool first = true;
+    };
+
+    void readLine(const std::wstring &line, Reader &reader);
+
+    // Store the block being read (its body is complete)
+    void closeBlock(Reader &reader);
+
+    // Read program text without sections (an empty name selects none)
+    bool loadText(std::string_view text, const std::string &name, const Grammar2D *previous);
+
+    // Offsets of the #section lines of a text, null if it has none
+    static std::shared_ptr<Sections> indexSections(std::string_view text);
+
+    // Read the common part and the named section (empty: the first) of sections
+    bool loadSection(const std::string &name, const Grammar2D *previous);
+
+    // Add the rules read (or take them over from previous) and compile them
+    bool endOfText(Reader &reader, const Grammar2D *previous);
+
     // Parse up to N whitespace-delimited integers from wide string
     template<int N> static void parse_ints(const std::wstring& s, int* vals) {
         size_t pos = 0;
@@ -149,16 +322,16 @@ public:
     wchar_t getControlKey(wchar_t control) const;
 
 private:
-    std::pair<char, int> getColorAndAttrs(wchar_t val, char def_color, int def_attrs = 0);
-    char getColor(wchar_t val, char def);
+    std::pair<short, int> getColorAndAttrs(wchar_t val, short def_color, int def_attrs = 0);
+    short getColor(wchar_t val, short def);
 };
 
 
-struct RuleApplication {
+// Applicable rule referenced by pointer into the grammar (no rule copy)
+struct RuleCandidate {
     std::pair<int, int> position;
-    Grammar2D::Rule rule;
-    size_t rule_index;
-    int weight;
+    const Grammar2D::Rule *rule;
+    size_t index;
 };
 
 struct ScreenArea {
@@ -170,27 +343,184 @@ struct ScreenArea {
     }
 };
 
+// Chooses how a batch of non-overlapping rules is applied: on the calling
+// thread or split into tasks for the pool. Running estimates (EWMA) of the
+// cost of applying one rule inline and of the fixed overhead of each task
+// count predict the time of every option for a batch size; the cheapest one
+// is used. Every few decisions another option is measured again, so the
+// choice follows the scene as it evolves.
+class DispatchTuner {
+public:
+    // Task counts to consider (up to max_tasks)
+    void configure(size_t max_tasks);
+
+    // Number of pool tasks for a batch (0 = apply inline)
+    size_t choose(size_t batch);
+
+    // Measured time of applying a batch with a number of tasks
+    void record(size_t tasks, size_t batch, double ns);
+
+    // Smallest batch for which the pool is expected to pay off (0 = none so far)
+    size_t minBatch() const;
+
+    // Estimated inline time over measured time of recent batches
+    double speedup() const;
+
+private:
+    double predict(size_t option, size_t batch) const;
+
+    std::vector<size_t> tasks;     // option -> task count (option 0 = inline)
+    std::vector<double> overhead;  // option -> fixed cost in ns, < 0 = unknown
+    double per_rule = -1.0;        // inline cost per rule in ns, < 0 = unknown
+    unsigned decisions = 0;
+    size_t probe = 0;
+    double inline_ns = 0.0;
+    double actual_ns = 0.0;
+};
+
+// Snapshot of a derivation's scheduler metrics (see Derivation::threadingStats)
+struct ThreadingStats {
+    static const int BATCH_BUCKETS = 8;
+    long steps = 0;                   // parallel engine steps with a rule applied
+    long parallel_steps = 0;          // ... with more than one rule applied
+    long batches[BATCH_BUCKETS] = {}; // steps by rules applied: 1, 2, 3-4, 5-8, ..., 65+
+    long considered = 0;              // candidates checked for overlaps when selecting
+    long rejected = 0;                // ... and dropped because they overlapped
+    long tasks = 0;                   // pool tasks run
+    double queue_wait_ms = 0.0;       // total time tasks waited in the pool queue
+    double task_run_ms = 0.0;         // total time tasks ran
+    double idle_ms = 0.0;             // total time the stepping thread waited for tasks
+    long speculated = 0;              // candidate lists gathered ahead (see #pipeline)
+    long speculation_hits = 0;        // ... and used by the next step
+    double speedup = 1.0;             // see DispatchTuner
+    size_t min_batch = 0;
+
+    static const char *bucketName(int bucket);
+};
+
+// Recent scene states of a derivation, to notice when it stopped changing or
+// keeps repeating a short cycle
+class StateHistory {
+public:
+    static const int MAX_PERIOD = 16;
+    // Repeated steps needed before a cycle is reported
+    static const int CONFIRM = 48;
+
+    void clear();
+
+    // Record the state hash after a step with its trigger key; forced when
+    // the step had a single applicable rule (no random choice)
+    void push(uint64_t state, wchar_t key, bool forced);
+
+    // Steps in a row that left the state unchanged
+    int unchanged() const { return still; }
+
+    // Period of a repeated cycle of forced steps (0 = none)
+    int cycle() const;
+
+    // Did a key trigger one of the last period steps
+    bool stepped(wchar_t key, int period) const;
+
+private:
+    uint64_t ring[MAX_PERIOD + 1] = {};
+    wchar_t keys[MAX_PERIOD + 1] = {};
+    size_t count = 0;
+    int runs[MAX_PERIOD + 1] = {};  // steps in a row equal to the one p steps before
+    int forced_run = 0;
+    int still = 0;
+    uint64_t last = 0;
+};
+
+// Cell changes of recent steps, to rewind and replay them (see #undo)
+//
+// Every step keeps the previous state of the cells it wrote. Rewinding and
+// replaying swap these states with the scene, so afterwards an entry holds
+// the state of the other direction and either way costs O(cells written).
+// The oldest steps are dropped once their cells exceed the limit.
+class StepJournal {
+public:
+    struct Change {
+        int r, c;
+        Cell memory;
+        wchar_t shown;
+        Look look;
+        wchar_t x;  // character in the derivation's x (space when absent)
+    };
+
+    struct Entry {
+        std::vector<Change> changes;
+        int score;
+    };
+
+    void configure(size_t max_cells);
+
+    void clear();
+
+    bool active() const { return limit > 0; }
+
+    size_t capacity() const { return limit; }
+
+    // Previous state of a cell the current step is about to write
+    void record(const Change &change) { pending.push_back(change); }
+
+    // End the current step; kept when it wrote cells or scored, replacing
+    // any rewound steps
+    void commit(int score);
+
+    // Step to undo, moving the position back (nullptr at the oldest kept step)
+    Entry *rewind();
+
+    // Rewound step to redo, moving the position forward (nullptr at the newest)
+    Entry *replay();
+
+private:
+    std::deque<Entry> entries;
+    size_t position = 0;  // entries before it are applied
+    size_t cells = 0;
+    size_t limit = 0;
+    std::vector<Change> pending;
+};
+
 class Derivation {
 public:
     std::unordered_map<std::pair<int, int>, wchar_t, hash_pair> x;
 
-    struct G {
-        wchar_t c;
-        char fore;
-        char back;
-        int fore_attrs;
-        int back_attrs;
-    };
+    typedef Cell G;
+
+    // Cell memory and displayed characters (for fast context lookup)
+    World world;
+
+    // Run without terminal output (replay and benchmark runs)
+    bool headless = false;
+
+    // Apply parallel rule batches on the calling thread (batch runs use one derivation per core)
+    bool inline_apply = false;
+
+    // Keep a journal of steps for rewinding (see #undo)
+    bool rewindable = true;
+
+    // Steps of the current program are journaled (z and y rewind and replay them)
+    bool rewinding() const { return journal.active(); }
 
-    G *memory;
-    wchar_t *screen_chars;  // Redundant storage of displayed characters for fast context lookup
+    // Count applications per rule, keyed by (LHS symbol, index in its rule list)
+    bool track_usage = false;
+    std::unordered_map<std::pair<wchar_t, size_t>, long, hash_pair> rule_usage;
 
     Derivation();
 
+    // Seed the derivation's own random generator
+    void seed(unsigned int s);
+
     void reset(const Grammar2D &g, int row, int col);
 
     void init(bool clear);
 
+    // Take over edited rules and settings of the running program keeping the
+    // scene (grid and world size have to be the same)
+    void reload(const Grammar2D &g);
+
+    // Set up the color pairs of the program's palette (only when it changed)
+    // and resolve the pairs of its rules
     void initColors();
 
     ~Derivation();
@@ -201,16 +531,76 @@ public:
 
     ScreenArea calculateRuleArea(int ro, int co, const Grammar2D::Rule &rule);
 
-    std::vector<RuleApplication> gatherApplicableRules(wchar_t key);
+    std::vector<RuleCandidate> gatherApplicableRules(wchar_t key);
 
+    // Step with the configured engine and record the resulting scene state
     bool stepMultithreaded(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds = nullptr);
 
+    // One rule per tile, tiles processed on the pool (see #step tiles)
+    bool stepTiles(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds = nullptr);
+
+    // Maximal set of non-overlapping rules in one step (see #step sweep)
+    bool stepSweep(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds = nullptr);
+
+    // One rule by rejection sampling over all candidates (see #step sample)
+    bool stepSample(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds = nullptr);
+
     std::pair<int, int> getThreadingStats();
 
+    // All scheduler metrics (safe to call while pool tasks run)
+    ThreadingStats threadingStats() const;
+
+    // Start gathering the candidates of the next step for a predicted key on
+    // the pool; the next step uses them unless the key or the scene differs
+    void prefetch(wchar_t key);
+
+    // The last step ran out of its time budget before visiting all nonterminals
+    bool partialStep() const { return partial; }
+
+    // Speedup of parallel rule application over applying inline (1 = none)
+    double getSpeedup() const { return tuner.speedup(); }
+
     static void initializeGlobalThreadPool(int max_threads = 0);
 
     void restart();
 
+    // Viewport scrolling when the world is larger than the terminal
+    bool scrollable() const;
+
+    void scrollView(int dr, int dc);
+
+    // Draw the whole viewport from world storage
+    void redraw();
+
+    // Change cell memory layout keeping the scene
+    void setLayout(World::Layout layout);
+
+    // All trigger keys used by the current program
+    std::vector<wchar_t> triggerKeys() const;
+
+    const Grammar2D &grammar() const { return g; }
+
+    // Number of nonterminal instances in the scene
+    long nonterminals() const;
+
+    // Letters and digits shown around the nonterminal of the last applied
+    // program switch rule within its row (section name of "#program <char> #")
+    std::wstring switchWord() const;
+
+    // Undo the last step or redo a rewound one, adjusting the score; false
+    // when the journal has no step in that direction
+    bool rewind(int &score);
+
+    bool forward(int &score);
+
+    // Zobrist hash of the scene (characters, cell memory and colors), kept up to date by writes
+    uint64_t stateHash() const { return state_hash; }
+
+    // 1 when no rule for the given keys can change the scene any more (fixed point),
+    // p > 1 when the last steps repeated a cycle of p states and no rule of a
+    // key that did not step in the cycle can change the scene, 0 otherwise
+    int settled(const std::vector<wchar_t> &keys);
+
     inline int wrap_row(int r) const {
         // Keep row 0 for status line, wrap rows 1 to row-1
         // Use cached effective height
@@ -223,22 +613,185 @@ public:
     }
 
 private:
-    template<bool DryRun>
-    bool apply_impl(int ro, int co, const Grammar2D::Rule &rule);
+    // Check a rule's LHS at a nonterminal position
+    bool matches(const std::pair<int, int> &pos, const Grammar2D::Rule &rule) const;
+
+    // Write a rule's RHS at a nonterminal position through the kernel of its shape
+    bool apply(const std::pair<int, int> &pos, const Grammar2D::Rule &rule) {
+        (this->*kernels[rule.shape])(pos, rule);
+        if (rule.load) {
+            switch_site.store(static_cast<uint64_t>(pos.first) << 32 | static_cast<uint32_t>(pos.second),
+                              std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Nonterminal position of the last applied program switch rule (row, column)
+    std::atomic<uint64_t> switch_site{0};
+
+    // Would applying a rule change the scene, score or program
+    bool changes(const std::pair<int, int> &pos, const Grammar2D::Rule &rule) const;
+
+    // Dispatch a step to the configured engine
+    bool stepEngine(wchar_t key, int &score, Grammar2D::Rule *dbgrule, std::vector<wchar_t> *sounds);
+
+    // Hash contribution of a cell's shown character, look and memory
+    uint64_t cellHash(int r, int c) const;
+
+    // Exchange a cell's state with a journaled one (see StepJournal)
+    void swapCell(StepJournal::Change &change);
+
+    // Common part of rewind and forward
+    bool revisit(StepJournal::Entry *entry, bool backwards);
+
+    template<bool Opaque, bool Recall, bool Single>
+    void applyKernel(const std::pair<int, int> &pos, const Grammar2D::Rule &rule);
+
+    typedef void (Derivation::*ApplyKernel)(const std::pair<int, int> &, const Grammar2D::Rule &);
+    static const ApplyKernel kernels[8];
+
+
+    // Color pair of a combination, -1 for a transparent one, 0 if not allocated yet
+    short getColor(short fore, short back) const {
+        if (static_cast<unsigned>(fore) >= static_cast<unsigned>(palette) || back >= palette) return -1;
+        return pair_table[fore * (palette + 1) + back + 1];
+    }
+
+    // Color pair of a combination, allocated on first use
+    short colorPair(short fore, short back) {
+        short pair = getColor(fore, back);
+        return pair != 0 ? pair : allocatePair(fore, back);
+    }
+
+    short allocatePair(short fore, short back);
+
+    // Draw a world cell if it lies within the viewport
+    void draw(int r, int c, wchar_t ch, const Look &look);
+
+    // Per-derivation random numbers in [0, RAND_MAX]
+    long random() { return static_cast<long>(rng() & RAND_MAX); }
+
+    void countUsage(wchar_t lhs, size_t index);
+
+    // Record a character in x (and in the nonterminal index when kept)
+    void place(const std::pair<int, int> &pos, wchar_t ch);
+
+    // Rebuild the nonterminal index from x
+    void indexSites();
+
+    // Applicable rules at all nonterminal positions; false when no nonterminal has rules for key
+    bool gather(wchar_t key, std::vector<RuleCandidate> &out);
+
+    // Applicable rules at nonterminal positions from the rotating cursor on, until the deadline
+    bool gatherBounded(wchar_t key, std::vector<RuleCandidate> &out);
+
+    // Candidates for the current step: prefetched, gatherBounded in time budgeted steps, gather otherwise
+    bool collect(wchar_t key, std::vector<RuleCandidate> &out);
+
+    // Wait for a running prefetch; keep its result only if it is for key and the current scene
+    void joinSpeculation(wchar_t key = 0);
+
+    // Indices of all rules of a matcher applicable at a position
+    void matchAt(const Matcher &m, const std::pair<int, int> &pos, std::vector<size_t> &out) const;
+
+    // Unwrapped bounding box of cells a rule reads or writes at a nonterminal position
+    ScreenArea footprint(const std::pair<int, int> &pos, const Grammar2D::Rule &rule) const;
+
+    // Run f(begin, end) over [0, n) split into ranges on the pool (or inline)
+    template<class F>
+    void forRanges(size_t n, F f);
+
+    // Enqueue a pool task measuring its queue wait and run time
+    template<class F>
+    std::future<void> submit(F f);
 
+    // Wait for tasks measuring the idle time of the calling thread
+    void waitAll(std::vector<std::future<void>> &futures);
 
-    int getColor(char fore, char back);
+    // Count a step of a parallel engine that applied n rules
+    void recordBatch(size_t n);
 
     Grammar2D g;
+    // World dimensions (row 0 reserved as status line)
     int col, row;
+    // Terminal dimensions and viewport offset into the world
+    int screen_col = 0, screen_row = 0;
+    int view_row = 0, view_col = 0;
     // Cached wrap calculation values
     bool clear_needed;
     int effective_max_row;
     int effective_max_col;
-    std::unordered_map<std::pair<char, char>, int, hash_pair> colors;
+    // Color pairs by fore and back color + 1 (-1 for transparent, 0 = not
+    // allocated); pairs 1 to 64 are the basic colors, extended ones are
+    // allocated in order of use
+    std::vector<short> pair_table;
+    int palette = 0;
+    int next_pair = 0;
+
+    std::mt19937 rng;
+
+    // Steps that can be rewound and replayed
+    StepJournal journal;
+
+    // Scene hash, states after recent steps and the last fixed point check
+    uint64_t state_hash = 0;
+    StateHistory history;
+    size_t choices = 0;       // candidates gathered by the current step
+    bool stalled = false;     // a step found no rule since the scene last changed
+    uint64_t checked_hash = 0;
+    int checked = -1;         // result of the fixed point check at checked_hash
+
+    // Could an applicable rule of the key change the scene
+    bool changeable(wchar_t key);
+
+    // Time budget of the current step (see #budget); the cursor indexes the
+    // concatenated site lists of the symbols having rules for the key
+    bool bounded = false;
+    bool partial = false;
+    std::chrono::steady_clock::time_point deadline;
+    size_t cursor = 0;
+
+    // Inline or pool application of selected rule batches
+    DispatchTuner tuner;
+
+    // Scheduler metrics, updated from pool tasks too
+    struct Counters {
+        std::atomic<long> steps{0};
+        std::atomic<long> parallel_steps{0};
+        std::atomic<long> batches[ThreadingStats::BATCH_BUCKETS] = {};
+        std::atomic<long> considered{0};
+        std::atomic<long> rejected{0};
+        std::atomic<long> tasks{0};
+        std::atomic<long long> queue_wait_ns{0};
+        std::atomic<long long> task_run_ns{0};
+        std::atomic<long long> idle_ns{0};
+        std::atomic<long> speculated{0};
+        std::atomic<long> speculation_hits{0};
+    } counters;
+
+    // Candidates gathered ahead on the pool, valid while the scene generation is unchanged
+    struct Speculation {
+        std::future<void> task;
+        wchar_t key = 0;
+        unsigned long generation = 0;
+        bool found = false;
+        std::vector<RuleCandidate> candidates;
+    } speculation;
+    unsigned long generation = 0;  // bumped by every step and scene reset
+    bool prefetched = false;       // speculation holds the current step's candidates
+
+    // Nonterminal positions per symbol (kept for the sample engine) and each
+    // position's slot in its list, for constant time removal
+    bool indexed = false;
+    std::unordered_map<wchar_t, std::vector<std::pair<int, int>>> sites;
+    std::unordered_map<std::pair<int, int>, size_t, hash_pair> site_slot;
+
+    // Cell claims of the sweep engine (a cell is taken when it holds the current stamp)
+    std::vector<unsigned> occupancy;
+    unsigned occupancy_stamp = 0;
 
     // Thread safety for screen operations
-    static std::mutex screen_mutex;
+    std::mutex screen_mutex;
 
     // Global thread pool for rule application (shared across all programs)
     static std::unique_ptr<ThreadPool> global_thread_pool;
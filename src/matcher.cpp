@@ -0,0 +1,121 @@
+#include "matcher.h"
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <unordered_map>
+
+// Guard against rule sets whose copies into branches would blow up the tree
+static const size_t MAX_NODES = 1 << 16;
+
+static inline uint64_t offsetKey(int dr, int dc) {
+    return static_cast<uint64_t>(static_cast<uint32_t>(dr)) << 32 | static_cast<uint32_t>(dc);
+}
+
+void Matcher::build(const std::vector<Item> &items) {
+    nodes.clear();
+    leaves.clear();
+    checks.clear();
+    r0 = c0 = INT_MAX;
+    r1 = c1 = INT_MIN;
+    for (const auto &item : items) {
+        for (const auto &check : item.checks) {
+            r0 = std::min(r0, check.dr);
+            r1 = std::max(r1, check.dr);
+            c0 = std::min(c0, check.dc);
+            c1 = std::max(c1, check.dc);
+        }
+    }
+    if (r0 > r1) r0 = r1 = c0 = c1 = 0;
+    if (!items.empty()) add(items);
+}
+
+int Matcher::add(std::vector<Item> items) {
+    const int index = static_cast<int>(nodes.size());
+    nodes.push_back({true, 0, 0, {}, -1, 0, 0});
+
+    // Branch on the offset with the most equality checks, as long as most
+    // rules test it (rules without a check there are copied into all branches);
+    // ties go to the first offset in reading order
+    std::unordered_map<uint64_t, int> counts;
+    for (const auto &item : items) {
+        for (const auto &check : item.checks) {
+            if (check.kind == Check::EQ) ++counts[offsetKey(check.dr, check.dc)];
+        }
+    }
+    std::pair<int, int> offset;
+    int best = 0;
+    for (const auto &count : counts) {
+        std::pair<int, int> at = {static_cast<int32_t>(count.first >> 32), static_cast<int32_t>(count.first)};
+        if (count.second > best || (count.second == best && at < offset)) {
+            best = count.second;
+            offset = at;
+        }
+    }
+
+    if (best < 2 || 2 * static_cast<size_t>(best) < items.size() || nodes.size() >= MAX_NODES) {
+        size_t begin = leaves.size();
+        for (const auto &item : items) {
+            leaves.push_back({item.rule, checks.size(), checks.size() + item.checks.size()});
+            checks.insert(checks.end(), item.checks.begin(), item.checks.end());
+        }
+        nodes[index].begin = begin;
+        nodes[index].end = leaves.size();
+        return index;
+    }
+
+    // Split the rules in one pass: by the value checked at the offset, or
+    // into other when they do not check it
+    std::vector<wchar_t> values;
+    std::unordered_map<wchar_t, size_t> slot;
+    std::vector<std::vector<Item>> branches;
+    std::vector<Item> other;
+    std::vector<std::pair<size_t, size_t>> order;  // (branch or SIZE_MAX, position) per item
+    for (auto &item : items) {
+        size_t k = 0;
+        while (k < item.checks.size() && !(item.checks[k].kind == Check::EQ && item.checks[k].dr == offset.first
+                                           && item.checks[k].dc == offset.second)) {
+            ++k;
+        }
+        if (k == item.checks.size()) {
+            order.push_back({SIZE_MAX, other.size()});
+            other.push_back(std::move(item));
+            continue;
+        }
+        wchar_t v = item.checks[k].a;
+        auto it = slot.find(v);
+        if (it == slot.end()) {
+            it = slot.insert({v, values.size()}).first;
+            values.push_back(v);
+            branches.emplace_back();
+        }
+        item.checks.erase(item.checks.begin() + k);
+        order.push_back({it->second, branches[it->second].size()});
+        branches[it->second].push_back(std::move(item));
+    }
+
+    std::vector<std::pair<wchar_t, int>> next;
+    for (size_t b = 0; b < values.size(); ++b) {
+        // Merge the rules of other back in their original order
+        std::vector<Item> branch;
+        if (other.empty()) {
+            branch = std::move(branches[b]);
+        } else {
+            branch.reserve(branches[b].size() + other.size());
+            for (const auto &o : order) {
+                if (o.first == b) branch.push_back(std::move(branches[b][o.second]));
+                else if (o.first == SIZE_MAX) branch.push_back(other[o.second]);
+            }
+        }
+        branches[b].clear();
+        next.push_back({values[b], add(std::move(branch))});
+    }
+    int other_index = other.empty() ? -1 : add(std::move(other));
+
+    Node &node = nodes[index];
+    node.leaf = false;
+    node.dr = offset.first;
+    node.dc = offset.second;
+    node.next = std::move(next);
+    node.other = other_index;
+    return index;
+}
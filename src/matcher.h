@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cwchar>
+
+// Decision tree matching all rules of one nonterminal (for one trigger key)
+//
+// A rule's LHS is a list of cell checks at offsets from the nonterminal.
+// Inner nodes read one cell and branch on its character, which decides the
+// equality checks of all rules at that offset at once; rules without an
+// equality check there are copied into every branch. Leaves list the rules
+// left in their original order together with their remaining checks
+// (inequalities, alternatives). A single walk therefore reads every shared
+// context cell once and yields all applicable rules.
+class Matcher {
+public:
+    struct Check {
+        enum Kind { EQ, NEQ, ONE_OF } kind;
+        int dr;
+        int dc;
+        wchar_t a;
+        wchar_t b;
+
+        inline bool test(wchar_t v) const {
+            switch (kind) {
+                case EQ: return v == a;
+                case NEQ: return v != a;
+                default: return v == a || v == b;
+            }
+        }
+    };
+
+    // Rule id (the caller's index) and its checks in reading order
+    struct Item {
+        size_t rule;
+        std::vector<Check> checks;
+    };
+
+    void build(const std::vector<Item> &items);
+
+    bool empty() const { return nodes.empty(); }
+
+    // Append ids of all rules whose checks pass, in ascending order.
+    // read(dr, dc) returns the shown character at an offset ('~' for space).
+    template<class Read>
+    void match(Read read, std::vector<size_t> &out) const {
+        if (nodes.empty()) return;
+        const Node *node = &nodes[0];
+        while (!node->leaf) {
+            wchar_t v = read(node->dr, node->dc);
+            int next = node->other;
+            for (const auto &edge : node->next) {
+                if (edge.first == v) {
+                    next = edge.second;
+                    break;
+                }
+            }
+            if (next < 0) return;
+            node = &nodes[next];
+        }
+        for (size_t l = node->begin; l < node->end; ++l) {
+            const Leaf &leaf = leaves[l];
+            bool ok = true;
+            for (size_t k = leaf.begin; ok && k < leaf.end; ++k) {
+                ok = checks[k].test(read(checks[k].dr, checks[k].dc));
+            }
+            if (ok) out.push_back(leaf.rule);
+        }
+    }
+
+    // Bounding box of all checked offsets
+    int r0 = 0, r1 = 0, c0 = 0, c1 = 0;
+
+private:
+    struct Node {
+        bool leaf;
+        int dr;
+        int dc;
+        // Branch per equality value, other branch (-1 = no rule left)
+        std::vector<std::pair<wchar_t, int>> next;
+        int other;
+        // Leaf range
+        size_t begin;
+        size_t end;
+    };
+
+    struct Leaf {
+        size_t rule;
+        size_t begin;
+        size_t end;
+    };
+
+    int add(std::vector<Item> items);
+
+    std::vector<Node> nodes;
+    std::vector<Leaf> leaves;
+    std::vector<Check> checks;
+};
@@ -0,0 +1,141 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Interval of scene values (nonterminal count, world memory, steps per second)
+static const std::chrono::milliseconds SCENE_INTERVAL{500};
+
+MetricsPublisher::~MetricsPublisher() {
+    if (listener < 0) return;
+    stop = true;
+    if (server.joinable()) server.join();
+    close(listener);
+    unlink(path.c_str());
+}
+
+bool MetricsPublisher::open(const std::string &socket_path) {
+    sockaddr_un addr = {};
+    if (socket_path.size() >= sizeof(addr.sun_path)) return false;
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, socket_path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    unlink(socket_path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+        close(fd);
+        return false;
+    }
+    listener = fd;
+    path = socket_path;
+    started = scene_time = std::chrono::steady_clock::now();
+    server = std::thread(&MetricsPublisher::serve, this);
+    return true;
+}
+
+void MetricsPublisher::program(const std::string &cfg) {
+    std::lock_guard<std::mutex> lock(config_mutex);
+    config = cfg;
+}
+
+void MetricsPublisher::publish(long s, long sc, double ms) {
+    steps.store(s, std::memory_order_relaxed);
+    score.store(sc, std::memory_order_relaxed);
+    frame_ms.store(ms, std::memory_order_relaxed);
+}
+
+bool MetricsPublisher::wantsScene() const {
+    return active() && std::chrono::steady_clock::now() - scene_time >= SCENE_INTERVAL;
+}
+
+void MetricsPublisher::scene(long count, long bytes) {
+    auto now = std::chrono::steady_clock::now();
+    long s = steps.load(std::memory_order_relaxed);
+    std::chrono::duration<double> elapsed = now - scene_time;
+    steps_per_second.store((s - scene_steps) / elapsed.count(), std::memory_order_relaxed);
+    scene_time = now;
+    scene_steps = s;
+    nonterminals.store(count, std::memory_order_relaxed);
+    world_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+std::string MetricsPublisher::snapshot() const {
+    // Resident memory from /proc (pages)
+    long pages_total = 0, pages_resident = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> pages_total >> pages_resident;
+
+    std::chrono::duration<double> uptime = std::chrono::steady_clock::now() - started;
+    std::string cfg;
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        cfg = config;
+    }
+
+    char buf[1024];
+    std::snprintf(buf, sizeof(buf),
+                  "zahradnice_pid %d\n"
+                  "zahradnice_program %s\n"
+                  "zahradnice_uptime_seconds %.1f\n"
+                  "zahradnice_steps %ld\n"
+                  "zahradnice_steps_per_second %.1f\n"
+                  "zahradnice_score %ld\n"
+                  "zahradnice_nonterminals %ld\n"
+                  "zahradnice_frame_ms %.3f\n"
+                  "zahradnice_world_bytes %ld\n"
+                  "zahradnice_resident_bytes %ld\n",
+                  static_cast<int>(getpid()), cfg.c_str(), uptime.count(),
+                  steps.load(std::memory_order_relaxed),
+                  steps_per_second.load(std::memory_order_relaxed),
+                  score.load(std::memory_order_relaxed),
+                  nonterminals.load(std::memory_order_relaxed),
+                  frame_ms.load(std::memory_order_relaxed),
+                  world_bytes.load(std::memory_order_relaxed),
+                  pages_resident * sysconf(_SC_PAGESIZE));
+    return buf;
+}
+
+void MetricsPublisher::serve() {
+    while (!stop) {
+        pollfd p = {listener, POLLIN, 0};
+        if (poll(&p, 1, 200) <= 0) continue;
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) continue;
+        std::string text = snapshot();
+        const char *data = text.c_str();
+        size_t left = text.size();
+        while (left > 0) {
+            ssize_t n = send(client, data, left, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            data += n;
+            left -= n;
+        }
+        close(client);
+    }
+}
+
+void LatencyHistogram::add(double ms) {
+    double us = ms * 1000.0;
+    int bucket = us < 1.0 ? 0 : static_cast<int>(4.0 * std::log2(us));
+    ++buckets[std::min(bucket, BUCKETS - 1)];
+    ++total;
+    maximum = std::max(maximum, ms);
+}
+
+double LatencyHistogram::percentile(double fraction) const {
+    long rank = static_cast<long>(std::ceil(fraction * total));
+    long seen = 0;
+    for (int b = 0; b < BUCKETS; ++b) {
+        seen += buckets[b];
+        // Upper edge of the bucket
+        if (seen >= rank && seen > 0) return std::min(maximum, std::exp2((b + 1) / 4.0) / 1000.0);
+    }
+    return maximum;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Live metrics of a running instance served on a Unix domain socket
+//
+// Every connection receives one snapshot in a line based text format and
+// is closed, e.g. `socat - UNIX-CONNECT:/tmp/zahradnice.sock`:
+//   zahradnice_pid 1234
+//   zahradnice_program programs/snake.cfg
+//   zahradnice_uptime_seconds 12.5
+//   zahradnice_steps 840
+//   ...
+// The main loop only stores atomics (publish); the socket is served by a
+// background thread, which also reads the process memory use.
+
+class MetricsPublisher {
+public:
+    ~MetricsPublisher();
+
+    // Listen on path (an existing socket file is replaced)
+    bool open(const std::string &path);
+
+    bool active() const { return listener >= 0; }
+
+    void program(const std::string &config);
+
+    // Frame values (cheap, called every frame)
+    void publish(long steps, long score, double frame_ms);
+
+    // Values expensive to collect are asked for twice a second
+    bool wantsScene() const;
+
+    void scene(long nonterminals, long world_bytes);
+
+private:
+    void serve();
+    std::string snapshot() const;
+
+    int listener = -1;
+    std::string path;
+    std::thread server;
+    std::atomic<bool> stop{false};
+
+    std::atomic<long> steps{0};
+    std::atomic<long> score{0};
+    std::atomic<double> frame_ms{0.0};
+    std::atomic<long> nonterminals{0};
+    std::atomic<long> world_bytes{0};
+    std::atomic<double> steps_per_second{0.0};
+    std::chrono::steady_clock::time_point started;
+
+    // Main thread only
+    std::chrono::steady_clock::time_point scene_time;
+    long scene_steps = 0;
+
+    mutable std::mutex config_mutex;
+    std::string config;
+};
+
+// Latency histogram on a logarithmic scale: four buckets per doubling from
+// 1 us to about 1 s, so percentiles are accurate to about 20 percent
+class LatencyHistogram {
+public:
+    void add(double ms);
+
+    long count() const { return total; }
+
+    double max() const { return maximum; }
+
+    // Latency in ms that the given fraction of samples does not exceed
+    double percentile(double fraction) const;
+
+private:
+    static const int BUCKETS = 80;
+    long buckets[BUCKETS] = {};
+    long total = 0;
+    double maximum = 0.0;
+};
@@ -0,0 +1,178 @@
+#include "pack.h"
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <SDL2/SDL_mixer.h>
+
+static const char MAGIC[4] = {'Z', 'P', 'A', 'K'};
+static const uint32_t VERSION = 1;
+static const size_t ALIGN = 16;
+// kind, path length, offset, size, frequency, format, channels
+static const size_t ENTRY_BYTES = 4 + 4 + 8 + 8 + 4 + 2 + 2;
+
+template<class T>
+static bool take(const char *&p, const char *end, T &value) {
+    if (static_cast<size_t>(end - p) < sizeof(T)) return false;
+    std::memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+template<class T>
+static void put(std::string &out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+Pack &Pack::instance() {
+    static Pack pack;
+    return pack;
+}
+
+Pack::~Pack() {
+    if (base) munmap(base, length);
+}
+
+std::string Pack::normalize(std::string_view path) {
+    bool absolute = !path.empty() && path[0] == '/';
+    std::vector<std::string_view> parts;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string_view::npos) end = path.size();
+        std::string_view part = path.substr(start, end - start);
+        if (part == "..") {
+            if (!parts.empty() && parts.back() != "..") {
+                parts.pop_back();
+            } else if (!absolute) {
+                parts.push_back(part);
+            }
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+        start = end + 1;
+    }
+    std::string result = absolute ? "/" : "";
+    for (size_t i = 0; i < parts.size(); ++i) {
+        if (i > 0) result += '/';
+        result += parts[i];
+    }
+    return result;
+}
+
+bool Pack::open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    char *data = static_cast<char *>(map);
+    size_t size = st.st_size;
+
+    const char *p = data, *end = data + size;
+    uint32_t version = 0, count = 0;
+    bool ok = std::memcmp(p, MAGIC, sizeof(MAGIC)) == 0;
+    p += sizeof(MAGIC);
+    ok = ok && take(p, end, version) && version == VERSION && take(p, end, count);
+    std::unordered_map<std::string, Entry> index;
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        uint32_t kind, path_length, frequency;
+        uint64_t offset, bytes;
+        uint16_t format, channels;
+        ok = take(p, end, kind) && take(p, end, path_length) && take(p, end, offset) && take(p, end, bytes)
+            && take(p, end, frequency) && take(p, end, format) && take(p, end, channels)
+            && static_cast<size_t>(end - p) >= path_length && offset <= size && bytes <= size - offset;
+        if (!ok) break;
+        index[std::string(p, path_length)] = {static_cast<Kind>(kind), data + offset, static_cast<size_t>(bytes),
+                                              static_cast<int>(frequency), format, channels};
+        p += path_length;
+    }
+    if (!ok) {
+        munmap(map, size);
+        return false;
+    }
+    if (base) munmap(base, length);
+    base = data;
+    length = size;
+    entries = std::move(index);
+    // Programs and sounds are read on demand, fault them in now
+    madvise(base, length, MADV_WILLNEED);
+    return true;
+}
+
+const Pack::Entry *Pack::find(const std::string &path) const {
+    auto it = entries.find(normalize(path));
+    return it != entries.end() ? &it->second : nullptr;
+}
+
+bool Pack::write(const std::string &archive, const std::vector<std::string> &files) {
+    struct Item {
+        std::string path;
+        Kind kind;
+        std::string data;
+        int frequency = 0;
+        uint16_t format = 0;
+        int channels = 0;
+    };
+    std::vector<Item> items;
+    int frequency = 0, channels = 0;
+    uint16_t format = 0;
+    bool mixer = Mix_QuerySpec(&frequency, &format, &channels) != 0;
+    for (const auto &file : files) {
+        Item item{normalize(file), PROGRAM, {}};
+        if (file.ends_with(".wav")) {
+            if (!mixer) return false;
+            Mix_Chunk *chunk = Mix_LoadWAV(file.c_str());
+            if (!chunk) return false;
+            item.kind = SOUND;
+            item.data.assign(reinterpret_cast<const char *>(chunk->abuf), chunk->alen);
+            item.frequency = frequency;
+            item.format = format;
+            item.channels = channels;
+            Mix_FreeChunk(chunk);
+        } else {
+            // gzread passes uncompressed files through
+            gzFile in = gzopen(file.c_str(), "rb");
+            if (!in) return false;
+            char buffer[4096];
+            int n;
+            while ((n = gzread(in, buffer, sizeof(buffer))) > 0) item.data.append(buffer, n);
+            gzclose(in);
+            if (n < 0) return false;
+        }
+        items.push_back(std::move(item));
+    }
+
+    size_t offset = sizeof(MAGIC) + 4 + 4;
+    for (const auto &item : items) offset += ENTRY_BYTES + item.path.size();
+    std::string out(MAGIC, sizeof(MAGIC));
+    put(out, VERSION);
+    put(out, static_cast<uint32_t>(items.size()));
+    for (const auto &item : items) {
+        offset = (offset + ALIGN - 1) / ALIGN * ALIGN;
+        put(out, static_cast<uint32_t>(item.kind));
+        put(out, static_cast<uint32_t>(item.path.size()));
+        put(out, static_cast<uint64_t>(offset));
+        put(out, static_cast<uint64_t>(item.data.size()));
+        put(out, static_cast<uint32_t>(item.frequency));
+        put(out, item.format);
+        put(out, static_cast<uint16_t>(item.channels));
+        out += item.path;
+        offset += item.data.size();
+    }
+    for (const auto &item : items) {
+        out.resize((out.size() + ALIGN - 1) / ALIGN * ALIGN, '\0');
+        out += item.data;
+    }
+    std::ofstream file(archive, std::ios::binary);
+    file.write(out.data(), out.size());
+    return static_cast<bool>(file);
+}
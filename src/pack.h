@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Read-only archive of programs and sounds mapped into memory (see --pack)
+//
+// Layout (little endian): magic "ZPAK", u32 version, u32 entry count, the
+// index of entries {u32 kind, u32 path length, u64 offset, u64 size,
+// u32 frequency, u16 format, u16 channels, path bytes}, then the data of
+// every entry aligned to 16 bytes. Programs are stored as plain text, sounds
+// as raw PCM in the mixer format they were converted to when packing. Once
+// opened, lookups only touch the mapping, no file system calls are made.
+class Pack {
+public:
+    enum Kind { PROGRAM = 0, SOUND = 1 };
+
+    struct Entry {
+        Kind kind;
+        const char *data;
+        size_t size;
+        // PCM format of a sound (see Mix_QuerySpec)
+        int frequency;
+        uint16_t format;
+        int channels;
+    };
+
+    // Archive used by the process (empty unless opened)
+    static Pack &instance();
+
+    Pack() = default;
+    Pack(const Pack &) = delete;
+    Pack &operator=(const Pack &) = delete;
+    ~Pack();
+
+    bool open(const std::string &path);
+
+    bool active() const { return base != nullptr; }
+
+    // Entry stored under a path (relative paths as given when packing,
+    // "./" and "dir/.." parts do not matter)
+    const Entry *find(const std::string &path) const;
+
+    // Pack files into an archive; .wav files are converted to the format of
+    // the open mixer, other files are stored as programs (.gz decompressed)
+    static bool write(const std::string &archive, const std::vector<std::string> &files);
+
+    // Path with "." and "dir/.." parts removed
+    static std::string normalize(std::string_view path);
+
+private:
+    char *base = nullptr;
+    size_t length = 0;
+    std::unordered_map<std::string, Entry> entries;
+};
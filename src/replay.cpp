@@ -0,0 +1,90 @@
+#include "replay.h"
+#include <cstdio>
+
+KeyRecorder::~KeyRecorder() {
+    if (active()) flush();
+}
+
+bool KeyRecorder::open(const std::string &path, unsigned int seed, int threads) {
+    file.open(path);
+    if (!file.is_open()) return false;
+    file << "#zahradnice-replay " << seed << " " << threads << "\n";
+    return true;
+}
+
+void KeyRecorder::size(int row, int col) {
+    if (!active() || (row == last_row && col == last_col)) return;
+    flush();
+    file << "#size " << row << " " << col << "\n";
+    last_row = row;
+    last_col = col;
+}
+
+void KeyRecorder::key(int step, wint_t key) {
+    if (!active()) return;
+    if (pending_count > 0 && step == pending_step && key == pending_key) {
+        ++pending_count;
+        return;
+    }
+    flush();
+    pending_step = step;
+    pending_key = key;
+    pending_count = 1;
+}
+
+void KeyRecorder::flush() {
+    if (pending_count == 0) return;
+    file << pending_step << " " << pending_key;
+    if (pending_count > 1) file << " " << pending_count;
+    file << "\n";
+    pending_count = 0;
+}
+
+bool KeyReplayer::open(const std::string &path) {
+    file.open(path);
+    if (!file.is_open()) return false;
+    std::string header;
+    if (!std::getline(file, header)) return false;
+    ++line;
+    return std::sscanf(header.c_str(), "#zahradnice-replay %u %d", &seed, &threads) == 2;
+}
+
+bool KeyReplayer::fetch() {
+    std::string text;
+    while (std::getline(file, text)) {
+        ++line;
+        if (text.empty()) continue;
+        if (text.rfind("#size ", 0) == 0) {
+            current = {Event::Size, 0, 0, 0, 0};
+            std::sscanf(text.c_str() + 6, "%d %d", &current.row, &current.col);
+            remaining = 1;
+            return true;
+        }
+        if (text[0] == '#') continue;
+        int step = 0;
+        unsigned int key = 0;
+        int repeat = 1;
+        if (std::sscanf(text.c_str(), "%d %u %d", &step, &key, &repeat) < 2) continue;
+        current = {Event::Key, step, static_cast<wint_t>(key), 0, 0};
+        remaining = repeat > 0 ? repeat : 1;
+        return true;
+    }
+    current = {Event::End, 0, 0, 0, 0};
+    remaining = 0;
+    return false;
+}
+
+KeyReplayer::Event KeyReplayer::next() {
+    if (remaining == 0) fetch();
+    if (current.kind != Event::End) --remaining;
+    return current;
+}
+
+void KeyReplayer::syncSize(int &row, int &col) {
+    while (remaining > 0 || fetch()) {
+        if (current.kind != Event::Size) return;
+        row = current.row;
+        col = current.col;
+        remaining = 0;
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <cwchar>
+
+// Key log for deterministic record/replay runs
+//
+// Text format, one event per line:
+//   #zahradnice-replay <seed> <auto-threads>   header (first line)
+//   #size <rows> <cols>                        terminal size change
+//   <step> <key> [<repeat>]                    delivered trigger key (wchar code)
+//
+// Together with the seed this reproduces a session exactly, including
+// synthetic B/M/T keys generated by the timing loop.
+
+class KeyRecorder {
+public:
+    ~KeyRecorder();
+
+    bool open(const std::string &path, unsigned int seed, int threads);
+
+    bool active() const { return file.is_open(); }
+
+    // Log terminal size (written only when it changes)
+    void size(int row, int col);
+
+    // Log a key delivered at the given step index (repeats are coalesced)
+    void key(int step, wint_t key);
+
+private:
+    void flush();
+
+    std::ofstream file;
+    int last_row = -1;
+    int last_col = -1;
+    int pending_step = 0;
+    wint_t pending_key = 0;
+    int pending_count = 0;
+};
+
+class KeyReplayer {
+public:
+    struct Event {
+        enum Kind { Key, Size, End } kind;
+        int step;
+        wint_t key;
+        int row;
+        int col;
+    };
+
+    bool open(const std::string &path);
+
+    // Next event from the log, repeated keys are expanded
+    Event next();
+
+    // Consume pending size events (called before a program is loaded)
+    void syncSize(int &row, int &col);
+
+    unsigned int seed = 0;
+    int threads = 0;
+    int line = 0;
+
+private:
+    bool fetch();
+
+    std::ifstream file;
+    Event current = {Event::End, 0, 0, 0, 0};
+    int remaining = 0;
+};
@@ -1,24 +1,144 @@
 #include "sample.h"
+#include "pack.h"
+#include <algorithm>
 
-sample::sample(const std::string &path, int volume)
-    : chunk(Mix_LoadWAV(path.c_str()), Mix_FreeChunk) {
-    if (!chunk.get()) {
-        // LOG("Couldn't load audio sample: ", path);
+sample_data::~sample_data() {
+    Mix_FreeChunk(chunk.load());
+}
+
+sample_cache &sample_cache::instance() {
+    static sample_cache cache;
+    return cache;
+}
+
+std::shared_ptr<sample_data> sample_cache::get(const std::string &path, int volume) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(path);
+    if (it != cache.end()) {
+        return it->second;
+    }
+    auto data = std::make_shared<sample_data>(volume);
+    cache.insert({path, data});
+    if (stop) {
+        return data;
+    }
+    // Packed samples in the mixer's format play from the archive mapping
+    const Pack &pack = Pack::instance();
+    const Pack::Entry *packed = pack.active() ? pack.find(path) : nullptr;
+    int frequency, channels;
+    uint16_t format;
+    if (packed && packed->kind == Pack::SOUND && Mix_QuerySpec(&frequency, &format, &channels)
+        && frequency == packed->frequency && format == packed->format && channels == packed->channels) {
+        Mix_Chunk *chunk = Mix_QuickLoad_RAW(reinterpret_cast<uint8_t *>(const_cast<char *>(packed->data)),
+                                             static_cast<uint32_t>(packed->size));
+        if (chunk) {
+            Mix_VolumeChunk(chunk, volume);
+            data->chunk.store(chunk);
+            return data;
+        }
+    }
+    pending.emplace_back(path, data);
+    if (!worker.joinable()) {
+        worker = std::thread(&sample_cache::run, this);
     }
+    condition.notify_one();
+    return data;
+}
+
+void sample_cache::run() {
+    for (;;) {
+        std::pair<std::string, std::shared_ptr<sample_data>> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stop || !pending.empty(); });
+            if (stop) return;
+            job = std::move(pending.front());
+            pending.pop_front();
+        }
+        Mix_Chunk *chunk = Mix_LoadWAV(job.first.c_str());
+        if (!chunk) {
+            // LOG("Couldn't load audio sample: ", path);
+            continue;
+        }
+        Mix_VolumeChunk(chunk, job.second->volume.load());
+        job.second->chunk.store(chunk);
+    }
+}
+
+void sample_cache::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        pending.clear();
+    }
+    condition.notify_all();
+    if (worker.joinable()) worker.join();
+    std::lock_guard<std::mutex> lock(mutex);
+    cache.clear();
+}
 
-    Mix_VolumeChunk(chunk.get(), volume);
+sample_cache::~sample_cache() {
+    shutdown();
+}
+
+sample::sample(const std::string &path, int volume)
+    : data(sample_cache::instance().get(path, volume)) {
 }
 
 // -1 here means we let SDL_mixer pick the first channel that is free
 // If no channel is free it'll return an err code.
 void sample::play() {
-    Mix_PlayChannel(-1, chunk.get(), 0);
+    Mix_Chunk *chunk = data->chunk.load();
+    if (chunk) Mix_PlayChannel(-1, chunk, 0);
 }
 
 void sample::play(int times) {
-    Mix_PlayChannel(-1, chunk.get(), times - 1);
+    Mix_Chunk *chunk = data->chunk.load();
+    if (chunk) Mix_PlayChannel(-1, chunk, times - 1);
 }
 
 void sample::set_volume(int volume) {
-    Mix_VolumeChunk(chunk.get(), volume);
+    data->volume.store(volume);
+    Mix_Chunk *chunk = data->chunk.load();
+    if (chunk) Mix_VolumeChunk(chunk, volume);
+}
+
+void sound_scheduler::add(wchar_t c, const std::string &path, sample *s, int interval_ms, int priority) {
+    auto [it, added] = entries.try_emplace(path, entry{s, interval_ms, priority});
+    if (!added) {
+        it->second.interval = std::max(it->second.interval, interval_ms);
+        it->second.priority = std::max(it->second.priority, priority);
+    }
+    characters[c] = &it->second;
+}
+
+void sound_scheduler::request(wchar_t c) {
+    auto it = characters.find(c);
+    if (it != characters.end()) {
+        it->second->pending = true;
+    }
+}
+
+void sound_scheduler::dispatch(long now) {
+    ready.clear();
+    for (auto &[path, e] : entries) {
+        if (!e.pending) continue;
+        e.pending = false;
+        if (e.last >= 0 && now - e.last < e.interval) continue;
+        ready.push_back(&e);
+    }
+    if (ready.empty()) return;
+
+    int budget = voices - Mix_Playing(-1);
+    if (budget < static_cast<int>(ready.size())) {
+        std::sort(ready.begin(), ready.end(), [](const entry *a, const entry *b) {
+            return a->priority > b->priority;
+        });
+        if (budget < 0) budget = 0;
+        ready.resize(budget);
+    }
+    for (entry *e : ready) {
+        e->s->play();
+        e->last = now;
+    }
 }
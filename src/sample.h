@@ -5,12 +5,58 @@
 
 #include <string>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <unordered_map>
+#include <vector>
 #include <SDL2/SDL_mixer.h>
 
+// Decoded audio shared by all samples loaded from the same path
+struct sample_data {
+    std::atomic<Mix_Chunk *> chunk{nullptr};
+    std::atomic<int> volume;
+
+    explicit sample_data(int volume) : volume(volume) {}
+    ~sample_data();
+};
+
+// Process-wide cache of decoded samples keyed by resolved path
+//
+// Samples are decoded on a background thread, so programs start
+// immediately and sounds become playable as they finish loading.
+// Switching programs reuses already decoded samples.
+class sample_cache {
+public:
+    static sample_cache &instance();
+
+    std::shared_ptr<sample_data> get(const std::string &path, int volume);
+
+    // Stop decoding and release all samples (call before closing audio)
+    void shutdown();
+
+    ~sample_cache();
+
+private:
+    sample_cache() = default;
+
+    void run();
+
+    std::unordered_map<std::string, std::shared_ptr<sample_data>> cache;
+    std::deque<std::pair<std::string, std::shared_ptr<sample_data>>> pending;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread worker;
+    bool stop = false;
+};
+
 class sample {
 public:
     sample(const std::string &path, int volume);
 
+    // Playing a sample that is still decoding is a no-op
     void play();
 
     void play(int times);
@@ -18,7 +64,44 @@ public:
     void set_volume(int volume);
 
 private:
-    std::unique_ptr<Mix_Chunk, void (*)(Mix_Chunk *)> chunk;
+    std::shared_ptr<sample_data> data;
+};
+
+// Per-frame sound dispatch
+//
+// Requests from all rules applied during a frame are collected, identical
+// samples are merged, each sample is rate limited by its minimum interval
+// and the free voices go to higher priorities first. Playback is started
+// once per frame, so busy multi-threaded steps do not hit the mixer for
+// every applied rule.
+class sound_scheduler {
+public:
+    explicit sound_scheduler(int voices) : voices(voices) {}
+
+    // Sound characters mapped to the same resolved path share one entry
+    // (requests merged, one rate limit) with the longest interval and the
+    // highest priority of them
+    void add(wchar_t c, const std::string &path, sample *s, int interval_ms, int priority);
+
+    // Request a sample to be played at the next dispatch
+    void request(wchar_t c);
+
+    // Start playback of pending requests (now in milliseconds)
+    void dispatch(long now);
+
+private:
+    struct entry {
+        sample *s;
+        int interval;
+        int priority;
+        long last = -1;
+        bool pending = false;
+    };
+
+    int voices;
+    std::unordered_map<std::string, entry> entries;  // by resolved path
+    std::unordered_map<wchar_t, entry *> characters;
+    std::vector<entry *> ready;
 };
 
 #endif //SAMPLE_H
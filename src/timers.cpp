@@ -0,0 +1,93 @@
+#include "timers.h"
+#include <algorithm>
+#include <cmath>
+
+Timers::Timers(const Grammar2D &cfg, unsigned int seed, double ms) : rng(seed) {
+    for (const auto &spec : cfg.timerSpecs()) {
+        int period = std::max(0, spec.period);
+        Channel channel = {spec.key, period, std::clamp(spec.jitter, 0, period / 2), 0.0, 0};
+        schedule(channel, ms);
+        channels.push_back(channel);
+    }
+}
+
+void Timers::schedule(Channel &channel, double ms) {
+    if (channel.period == 0) {
+        channel.deadline = ms;
+        return;
+    }
+    // Next grid point after ms (missed ticks are skipped)
+    double tick = (std::floor(ms / channel.period) + 1.0) * channel.period;
+    if (channel.jitter > 0) {
+        std::uniform_real_distribution<double> shift(-channel.jitter, channel.jitter);
+        tick += shift(rng);
+        if (tick <= ms) tick += channel.period;
+    }
+    channel.deadline = tick;
+}
+
+wint_t Timers::due(double ms) {
+    // Earliest deadline first, declaration order (B, M, T, #timer) on ties;
+    // continuous channels only when no periodic one is due, taking turns
+    // (each is rescheduled to the time it last fired)
+    Channel *next = nullptr;
+    for (auto &channel : channels) {
+        if (channel.period == 0 || channel.deadline > ms) continue;
+        if (!next || channel.deadline < next->deadline) next = &channel;
+    }
+    if (!next) {
+        for (auto &channel : channels) {
+            if (channel.period != 0 || channel.deadline > ms) continue;
+            if (!next || channel.deadline < next->deadline) next = &channel;
+        }
+    }
+    if (!next) return 0;
+    ++next->ticks;
+    schedule(*next, ms);
+    return next->key;
+}
+
+wint_t Timers::upcoming(double ms) const {
+    const Channel *next = nullptr;
+    for (const auto &channel : channels) {
+        if (channel.period == 0) continue;
+        if (!next || channel.deadline < next->deadline) next = &channel;
+    }
+    if (next && next->deadline <= ms) return next->key;
+    const Channel *continuous = nullptr;
+    for (const auto &channel : channels) {
+        if (channel.period != 0 || channel.deadline > ms) continue;
+        if (!continuous || channel.deadline < continuous->deadline) continuous = &channel;
+    }
+    if (continuous) return continuous->key;
+    return next ? next->key : 0;
+}
+
+int Timers::wait(double ms) const {
+    double first = -1.0;
+    for (const auto &channel : channels) {
+        if (first < 0.0 || channel.deadline < first) first = channel.deadline;
+    }
+    if (first < 0.0) return -1;
+    return static_cast<int>(std::ceil(std::max(0.0, first - ms)));
+}
+
+void Timers::defer(wchar_t key, double until) {
+    for (auto &channel : channels) {
+        if (channel.key == key) channel.deadline = std::max(channel.deadline, until);
+    }
+}
+
+bool Timers::continuous(wchar_t key) const {
+    for (const auto &channel : channels) {
+        if (channel.key == key) return channel.period == 0;
+    }
+    return false;
+}
+
+long Timers::fired(wchar_t key) const {
+    for (const auto &channel : channels) {
+        if (channel.key == key) return channel.ticks;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <random>
+#include <cwchar>
+#include "grammar.h"
+
+// Trigger keys generated by time (B/M/T of #timing and #timer channels)
+//
+// Every channel ticks on a fixed grid of its period, optionally shifted by a
+// random jitter per tick (at most half the period); ticks missed while the
+// program was busy are skipped, not made up. Period 0 means continuous: due
+// whenever no other channel is. Jitter uses its own random generator, so it
+// does not change the rules chosen by a derivation.
+class Timers {
+public:
+    // Channels start at the given time since program start (e.g. when the
+    // timer lines of a running program changed)
+    Timers(const Grammar2D &cfg, unsigned int seed, double ms = 0.0);
+
+    // Key of the most overdue channel at the given time since program start
+    // (0 if none); other due channels follow in the next calls
+    wint_t due(double ms);
+
+    // Key the next call of due will return unless time runs past further ticks
+    wint_t upcoming(double ms) const;
+
+    // Milliseconds until a channel is due (0 = due now, -1 = no channels)
+    int wait(double ms) const;
+
+    // Hold a channel back until the given time (its step found no rule)
+    void defer(wchar_t key, double until);
+
+    bool continuous(wchar_t key) const;
+
+    // Ticks of a channel so far
+    long fired(wchar_t key) const;
+
+private:
+    struct Channel {
+        wchar_t key;
+        int period;
+        int jitter;
+        double deadline;  // next tick
+        long ticks;
+    };
+
+    // Schedule the tick after the given time
+    void schedule(Channel &channel, double ms);
+
+    std::vector<Channel> channels;
+    std::mt19937 rng;
+};
@@ -0,0 +1,40 @@
+#include "watch.h"
+#include <sys/inotify.h>
+#include <unistd.h>
+
+FileWatcher::~FileWatcher() {
+    close();
+}
+
+void FileWatcher::close() {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+}
+
+bool FileWatcher::open(const std::string &path) {
+    close();
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    name = slash == std::string::npos ? path : path.substr(slash + 1);
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return false;
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool FileWatcher::changed() {
+    bool written = false;
+    alignas(inotify_event) char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            auto *event = reinterpret_cast<inotify_event *>(p);
+            if (event->len > 0 && name == event->name) written = true;
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+    return written;
+}
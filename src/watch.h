@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+// Notices writes of a file through inotify. The file's directory is watched,
+// since editors often save by renaming a new file over the old one.
+class FileWatcher {
+public:
+    FileWatcher() = default;
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+    ~FileWatcher();
+
+    // Watch path instead of the file watched so far
+    bool open(const std::string &path);
+
+    bool active() const { return fd >= 0; }
+
+    // The file was written since the last call (never blocks)
+    bool changed();
+
+private:
+    void close();
+
+    int fd = -1;
+    std::string name;
+};
@@ -0,0 +1,148 @@
+#include "world.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+// Chunk size target (tiles per chunk side are rounded to a power of two)
+static const int CHUNK_CELLS = 4096;
+
+// Spread the lower 16 bits of v to even bit positions (Morton order)
+static uint32_t spread_bits(uint32_t v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+World::~World() {
+    clear();
+}
+
+const char *World::layoutName(Layout layout) {
+    switch (layout) {
+        case ROWS: return "rows";
+        case TILES: return "tiles";
+        default: return "morton";
+    }
+}
+
+void World::resize(int rows, int cols, int tile_width, int tile_height, Layout layout) {
+    clear();
+    rows_ = rows;
+    cols_ = cols;
+    layout_ = layout;
+
+    const uint32_t tw = std::max(1, tile_width);
+    const uint32_t th = std::max(1, tile_height);
+    const uint32_t tile_cells = tw * th;
+
+    uint32_t tiles = 1;
+    while ((tiles * 2) * (tiles * 2) * tile_cells <= CHUNK_CELLS) tiles *= 2;
+
+    const uint32_t chunk_rows = tiles * th;
+    const uint32_t chunk_cols = tiles * tw;
+    const size_t cells = static_cast<size_t>(chunk_rows) * chunk_cols;
+    const uint32_t chunks_per_row = (cols + chunk_cols - 1) / chunk_cols;
+
+    row_axis.resize(rows);
+    for (uint32_t r = 0; r < static_cast<uint32_t>(rows); ++r) {
+        uint32_t lr = r % chunk_rows;
+        uint32_t local;
+        if (layout == ROWS) {
+            local = lr * chunk_cols;
+        } else if (layout == TILES) {
+            local = (lr / th) * tiles * tile_cells + (lr % th) * tw;
+        } else {
+            local = (spread_bits(lr / th) << 1) * tile_cells + (lr % th) * tw;
+        }
+        row_axis[r] = {(r / chunk_rows) * chunks_per_row, local};
+    }
+
+    col_axis.resize(cols);
+    for (uint32_t c = 0; c < static_cast<uint32_t>(cols); ++c) {
+        uint32_t lc = c % chunk_cols;
+        uint32_t local;
+        if (layout == ROWS) {
+            local = lc;
+        } else if (layout == TILES) {
+            local = (lc / tw) * tile_cells + lc % tw;
+        } else {
+            local = spread_bits(lc / tw) * tile_cells + lc % tw;
+        }
+        col_axis[c] = {c / chunk_cols, local};
+    }
+
+    chars_offset = cells * sizeof(Cell);
+    looks_offset = chars_offset + cells * sizeof(wchar_t);
+    chunk_bytes = looks_offset + cells * sizeof(Look);
+
+    empty.reset(static_cast<char *>(::operator new(chunk_bytes)));
+    for (size_t i = 0; i < cells; ++i) {
+        memoryOf(empty.get())[i] = {L' ', 7, 0, 0, 0};
+        charsOf(empty.get())[i] = L' ';
+        looksOf(empty.get())[i] = {0, 0};
+    }
+
+    chunk_count = static_cast<size_t>((rows + chunk_rows - 1) / chunk_rows) * chunks_per_row;
+    chunks.reset(new std::atomic<char *>[chunk_count]);
+    for (size_t i = 0; i < chunk_count; ++i) {
+        chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+void World::clear() {
+    for (size_t i = 0; i < chunk_count; ++i) {
+        ::operator delete(chunks[i].exchange(nullptr));
+    }
+}
+
+void World::copyFrom(const World &other) {
+    clear();
+    for (int r = 0; r < std::min(rows_, other.rows_); ++r) {
+        for (int c = 0; c < std::min(cols_, other.cols_); ++c) {
+            if (!other.chunks[other.index(r, c)].load(std::memory_order_relaxed)) continue;
+            memoryAt(r, c) = other.memory(r, c);
+            show(r, c, other.shown(r, c), other.look(r, c));
+        }
+    }
+}
+
+void World::relayout(int tile_width, int tile_height, Layout layout) {
+    World fresh;
+    fresh.resize(rows_, cols_, tile_width, tile_height, layout);
+    fresh.copyFrom(*this);
+    std::swap(layout_, fresh.layout_);
+    std::swap(chunk_count, fresh.chunk_count);
+    std::swap(chunk_bytes, fresh.chunk_bytes);
+    std::swap(chars_offset, fresh.chars_offset);
+    std::swap(looks_offset, fresh.looks_offset);
+    row_axis.swap(fresh.row_axis);
+    col_axis.swap(fresh.col_axis);
+    empty.swap(fresh.empty);
+    chunks.swap(fresh.chunks);
+}
+
+size_t World::allocated() const {
+    size_t n = 0;
+    for (size_t i = 0; i < chunk_count; ++i) {
+        if (chunks[i].load(std::memory_order_relaxed)) ++n;
+    }
+    return n;
+}
+
+char *World::touch(int r, int c) {
+    auto &slot = chunks[index(r, c)];
+    char *k = slot.load(std::memory_order_acquire);
+    if (k) return k;
+
+    char *fresh = static_cast<char *>(::operator new(chunk_bytes));
+    std::memcpy(fresh, empty.get(), chunk_bytes);
+    if (slot.compare_exchange_strong(k, fresh, std::memory_order_acq_rel)) {
+        return fresh;
+    }
+    // Another thread allocated the chunk first
+    ::operator delete(fresh);
+    return k;
+}
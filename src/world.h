@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// One cell of derivation memory
+struct Cell {
+    wchar_t c;
+    short fore;  // palette colors, back -1 = transparent
+    short back;
+    int fore_attrs;
+    int back_attrs;
+};
+
+// How a cell is currently shown (color pair and attributes)
+struct Look {
+    short pair;
+    int attrs;
+};
+
+// Sparse cell storage of a (possibly larger than terminal) world
+//
+// The world is split into chunks which are allocated on first write, reads
+// of untouched chunks return a shared blank chunk. Memory therefore stays
+// proportional to the touched area.
+//
+// Chunks consist of tiles of the program's grid size. Cells are ordered
+// within a chunk according to the layout, so that multi-row rule patterns
+// on a grid stay close in memory. All layouts are separable into a row and
+// a column part, accessors do two table lookups and no branching.
+class World {
+public:
+    enum Layout {
+        ROWS,    // row-major cells
+        TILES,   // row-major tiles, row-major cells within a tile
+        MORTON   // Z-order tiles, row-major cells within a tile
+    };
+
+    World() = default;
+    World(const World &) = delete;
+    World &operator=(const World &) = delete;
+    ~World();
+
+    // Set dimensions and layout and drop all chunks
+    void resize(int rows, int cols, int tile_width = 1, int tile_height = 1, Layout layout = MORTON);
+
+    // Drop all chunks (world becomes blank)
+    void clear();
+
+    // Copy all cells of another world of the same dimensions
+    void copyFrom(const World &other);
+
+    // Change tile size and layout keeping contents
+    void relayout(int tile_width, int tile_height, Layout layout);
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    Layout layout() const { return layout_; }
+
+    // Number of allocated chunks and their size in bytes
+    size_t allocated() const;
+    size_t chunkBytes() const { return chunk_bytes; }
+
+    // Coordinates must be within [0, rows) x [0, cols)
+    inline const Cell &memory(int r, int c) const {
+        return memoryOf(chunk(r, c))[local(r, c)];
+    }
+
+    inline wchar_t shown(int r, int c) const {
+        return charsOf(chunk(r, c))[local(r, c)];
+    }
+
+    inline const Look &look(int r, int c) const {
+        return looksOf(chunk(r, c))[local(r, c)];
+    }
+
+    // Writers allocate the chunk on demand (safe to call from pool threads)
+    inline Cell &memoryAt(int r, int c) {
+        return memoryOf(touch(r, c))[local(r, c)];
+    }
+
+    inline void show(int r, int c, wchar_t ch, Look look) {
+        char *k = touch(r, c);
+        charsOf(k)[local(r, c)] = ch;
+        looksOf(k)[local(r, c)] = look;
+    }
+
+    static const char *layoutName(Layout layout);
+
+private:
+    // Chunk index and offset within chunk contributed by a row or a column
+    struct Axis {
+        uint32_t chunk;
+        uint32_t local;
+    };
+
+    inline size_t index(int r, int c) const {
+        return row_axis[r].chunk + col_axis[c].chunk;
+    }
+
+    inline uint32_t local(int r, int c) const {
+        return row_axis[r].local + col_axis[c].local;
+    }
+
+    inline const char *chunk(int r, int c) const {
+        const char *k = chunks[index(r, c)].load(std::memory_order_acquire);
+        return k ? k : empty.get();
+    }
+
+    // Chunk block: cells_per_chunk Cells, then chars, then looks
+    inline Cell *memoryOf(char *k) const { return reinterpret_cast<Cell *>(k); }
+    inline const Cell *memoryOf(const char *k) const { return reinterpret_cast<const Cell *>(k); }
+    inline wchar_t *charsOf(char *k) const { return reinterpret_cast<wchar_t *>(k + chars_offset); }
+    inline const wchar_t *charsOf(const char *k) const { return reinterpret_cast<const wchar_t *>(k + chars_offset); }
+    inline Look *looksOf(char *k) const { return reinterpret_cast<Look *>(k + looks_offset); }
+    inline const Look *looksOf(const char *k) const { return reinterpret_cast<const Look *>(k + looks_offset); }
+
+    char *touch(int r, int c);
+
+    struct FreeChunk {
+        void operator()(char *k) const { ::operator delete(k); }
+    };
+
+    int rows_ = 0;
+    int cols_ = 0;
+    Layout layout_ = MORTON;
+    size_t chunk_count = 0;
+    size_t chunk_bytes = 0;
+    size_t chars_offset = 0;
+    size_t looks_offset = 0;
+    std::vector<Axis> row_axis;
+    std::vector<Axis> col_axis;
+    std::unique_ptr<char, FreeChunk> empty;
+    std::unique_ptr<std::atomic<char *>[]> chunks;
+};
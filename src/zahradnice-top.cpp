@@ -0,0 +1,94 @@
+// Monitor running instances started with --metrics <socket>
+//
+// Usage: zahradnice-top [-d <seconds>] [-n <refreshes>] <socket>...
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Read one snapshot ("key value" lines); empty when the instance is not running
+static std::map<std::string, std::string> query(const std::string &path) {
+    std::map<std::string, std::string> values;
+    sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) return values;
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return values;
+    std::string text;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0) {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) text.append(buf, n);
+    }
+    close(fd);
+
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t space = line.find(' ');
+        if (space != std::string::npos) values[line.substr(0, space)] = line.substr(space + 1);
+    }
+    return values;
+}
+
+static std::string value(const std::map<std::string, std::string> &values, const char *key) {
+    auto it = values.find(std::string("zahradnice_") + key);
+    return it != values.end() ? it->second : "-";
+}
+
+int main(int argc, char *argv[]) {
+    double delay = 1.0;
+    long refreshes = -1;
+    std::vector<std::string> sockets;
+    for (int i = 1; i < argc; ++i) {
+        std::string param = argv[i];
+        if (param == "-d" && i + 1 < argc) {
+            delay = std::atof(argv[++i]);
+        } else if (param == "-n" && i + 1 < argc) {
+            refreshes = std::atol(argv[++i]);
+        } else if (param == "-h" || param == "--help") {
+            sockets.clear();
+            break;
+        } else {
+            sockets.push_back(param);
+        }
+    }
+    if (sockets.empty()) {
+        std::fprintf(stderr, "Usage: zahradnice-top [-d <seconds>] [-n <refreshes>] <socket>...\n");
+        return 1;
+    }
+
+    bool tty = isatty(STDOUT_FILENO);
+    for (long r = 0; refreshes < 0 || r < refreshes; ++r) {
+        if (r > 0) std::this_thread::sleep_for(std::chrono::duration<double>(delay));
+        if (tty) std::printf("\033[H\033[2J");
+        std::printf("%-24s %7s %10s %8s %7s %8s %9s %8s  %s\n",
+                    "SOCKET", "PID", "STEPS", "STEPS/S", "SCORE", "NONTERM", "FRAME ms", "RSS MB", "PROGRAM");
+        for (const auto &path : sockets) {
+            auto values = query(path);
+            if (values.empty()) {
+                std::printf("%-24s %7s\n", path.c_str(), "down");
+                continue;
+            }
+            double rss = std::atof(value(values, "resident_bytes").c_str()) / (1024.0 * 1024.0);
+            std::printf("%-24s %7s %10s %8s %7s %8s %9s %8.1f  %s\n", path.c_str(),
+                        value(values, "pid").c_str(), value(values, "steps").c_str(),
+                        value(values, "steps_per_second").c_str(), value(values, "score").c_str(),
+                        value(values, "nonterminals").c_str(), value(values, "frame_ms").c_str(),
+                        rss, value(values, "program").c_str());
+        }
+        std::fflush(stdout);
+    }
+    return 0;
+}
@@ -6,11 +6,29 @@
 #include <chrono>
 #include <SDL2/SDL_mixer.h>
 #include "sample.h"
+#include "replay.h"
+#include "metrics.h"
+#include "timers.h"
+#include "watch.h"
+#include "pack.h"
 #include <cstdlib>
 #include <algorithm>
 #include <unistd.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <unordered_set>
+#include <deque>
+
+// A file exists in the archive when one is used (the disk is not asked then), otherwise on disk
+static bool file_exists(const std::string &path) {
+    const Pack &pack = Pack::instance();
+    if (pack.active()) return pack.find(path) != nullptr;
+    struct stat buffer;
+    return stat(path.c_str(), &buffer) == 0 && S_ISREG(buffer.st_mode);
+}
 
 std::string resolve_sound_path(const std::string& sound_path, const std::string& program_dir) {
     // If path is already absolute, use as-is
@@ -18,11 +36,9 @@ std::string resolve_sound_path(const std::string& sound_path, const std::string&
         return sound_path;
     }
 
-    struct stat buffer;
-
     // Try relative to program file directory first
     std::string program_relative = program_dir + "/" + sound_path;
-    if (stat(program_relative.c_str(), &buffer) == 0) {
+    if (file_exists(program_relative)) {
         return program_relative;
     }
 
@@ -36,6 +52,12 @@ std::string resolve_program_path(const std::string& program_path, const std::str
         return program_path;
     }
 
+    // A section suffix (see #section) is kept as it is
+    auto [file, section] = Grammar2D::splitSection(program_path);
+    if (!section.empty()) {
+        return resolve_program_path(file, current_config) + "#" + section;
+    }
+
     // If program path is already absolute, use as-is
     if (!program_path.empty() && program_path[0] == '/') {
         return program_path;
@@ -59,29 +81,28 @@ std::string resolve_program_path(const std::string& program_path, const std::str
     }
 
     // Apply file completion logic from loadFromFile
-    struct stat buffer;
 
     // Try original path first
-    if (stat(base_path.c_str(), &buffer) == 0 && S_ISREG(buffer.st_mode)) {
+    if (file_exists(base_path)) {
         return base_path;
     }
 
     // If not .cfg, try adding /index.cfg
     if (!base_path.ends_with(".cfg") && !base_path.ends_with(".cfg.gz")) {
         std::string index_path = base_path + "/index.cfg";
-        if (stat(index_path.c_str(), &buffer) == 0) {
+        if (file_exists(index_path)) {
             return index_path;
         }
         // Try compressed index
         std::string index_gz_path = index_path + ".gz";
-        if (stat(index_gz_path.c_str(), &buffer) == 0) {
+        if (file_exists(index_gz_path)) {
             return index_gz_path;
         }
     }
     // Try adding .gz to original path
     else {
         std::string gz_path = base_path + ".gz";
-        if (stat(gz_path.c_str(), &buffer) == 0) {
+        if (file_exists(gz_path)) {
             return gz_path;
         }
     }
@@ -90,60 +111,625 @@ std::string resolve_program_path(const std::string& program_path, const std::str
     return base_path;
 }
 
+// Mixer channels, also the per-frame voice budget of the sound scheduler
+const int SOUND_CHANNELS = 32;
+
 void clear_status(size_t len) {
     std::wstring empty(len, L' ');
     mvaddwstr(0, 0, empty.c_str());
 }
 
+// State of a running session shared by the terminal and replay loops
+struct Session {
+    std::string config;
+    std::vector<std::string> caller_stack;  // Stack of calling programs
+    int score = 0;
+    int steps = 0;
+    bool paused = true;
+    bool success = true;
+    bool overlay = false;      // scheduler metrics shown over the scene
+    bool overlay_key = false;  // o toggles the overlay (--overlay), a rule key otherwise
+    int settled = 0;       // see Derivation::settled
+    Grammar2D::Rule rule = {};  // Initialize all members to zero/false
+};
+
+std::string to_utf8(const std::wstring &text) {
+    size_t len = std::wcstombs(nullptr, text.c_str(), 0);
+    if (len == static_cast<size_t>(-1)) {
+        return std::string(text.begin(), text.end());
+    }
+    std::string result(len, '\0');
+    std::wcstombs(&result[0], text.c_str(), len);
+    return result;
+}
+
+bool load_program(Grammar2D &cfg, const std::string &config, int auto_threads, int budget_us = -1,
+                  const Grammar2D *previous = nullptr) {
+    const Pack &pack = Pack::instance();
+    if (pack.active()) {
+        // Programs come only from the archive
+        const Pack::Entry *packed = pack.find(Grammar2D::splitSection(config).first);
+        if (!packed || packed->kind != Pack::PROGRAM
+            || !cfg.loadFromBuffer(packed->data, packed->size, config, previous)) {
+            return false;
+        }
+    } else if (cfg.loadFromFile(config, previous) == false) {
+        return false;
+    }
+    // Auto-detect thread count if not set
+    if (cfg.thread_count == 0) {
+        cfg.thread_count = auto_threads;
+    }
+    // Command line budget overrides the program's #budget
+    if (budget_us >= 0) {
+        cfg.step_budget_us = budget_us;
+    }
+    return true;
+}
+
+// Switch programs if the last applied rule requests it, true if current program is left
+bool follow_program_switch(Session &s, const Grammar2D &cfg) {
+    if (!s.success || !s.rule.load || s.rule.sound == 0) {
+        return false;
+    }
+    // Look up program path from dictionary
+    auto it = cfg.program_paths.find(s.rule.sound);
+    if (it == cfg.program_paths.end()) {
+        return false;
+    }
+    std::string new_program = it->second;
+    if (new_program.starts_with("#")) {
+        return false;  // section of this program, see follow_section_switch
+    }
+    if (new_program == "return") {
+        // Pop from caller stack
+        if (!s.caller_stack.empty()) {
+            s.config = s.caller_stack.back();
+            s.caller_stack.pop_back();
+        } else {
+            s.config = "quit";  // No caller to return to
+        }
+    } else {
+        // Push current program to stack and switch
+        s.caller_stack.push_back(s.config);
+        s.config = resolve_program_path(new_program, s.config);
+    }
+    return true;
+}
+
+// Load another section of the program if the last applied rule requests it
+// (#program <char> #[<name>]), keeping the scene; timers are restarted at
+// the given time only if the section changes them. True if the section changed.
+bool follow_section_switch(Session &s, Derivation &w, Grammar2D &cfg, Timers *timers, unsigned int seed,
+                           double ms, int auto_threads, int budget_us = -1) {
+    if (!s.success || !s.rule.load || s.rule.sound == 0 || !cfg.sections) {
+        return false;
+    }
+    auto it = cfg.program_paths.find(s.rule.sound);
+    if (it == cfg.program_paths.end() || !it->second.starts_with("#")) {
+        return false;
+    }
+    s.rule = {};
+    // Without a name the section is named by the word the rule wrote
+    std::string name = it->second.size() > 1 ? it->second.substr(1) : to_utf8(w.switchWord());
+    if (name == cfg.section || !cfg.sections->index.count(name)) {
+        return false;
+    }
+    Grammar2D next;
+    if (!load_program(next, cfg.path + "#" + name, auto_threads, budget_us, &cfg)) {
+        return false;
+    }
+    bool same_timers = next.timerSpecs() == cfg.timerSpecs();
+    cfg = std::move(next);
+    if (timers && !same_timers) *timers = Timers(cfg, seed, ms);
+    w.reload(cfg);
+    s.config = cfg.path + "#" + name;
+    return true;
+}
+
+enum class KeyOutcome { Stepped, Rewound, Restarted, Toggled, Scrolled, Quit };
+
+// Scheduler metrics over the top left of the scene (toggled by o)
+void draw_overlay(const ThreadingStats &t, const LatencyHistogram &latency, int row, int col) {
+    std::vector<std::string> lines;
+    char buf[256];
+    std::snprintf(buf, sizeof(buf), "steps %ld, parallel %ld, speedup %.2fx, pool from %zu rules",
+                  t.steps, t.parallel_steps, t.speedup, t.min_batch);
+    lines.push_back(buf);
+    std::string hist = "rules/step";
+    for (int b = 0; b < ThreadingStats::BATCH_BUCKETS; ++b) {
+        hist += std::string(" ") + ThreadingStats::bucketName(b) + ":" + std::to_string(t.batches[b]);
+    }
+    lines.push_back(hist);
+    std::snprintf(buf, sizeof(buf), "overlap rejects %ld of %ld (%.1f%%)",
+                  t.rejected, t.considered, t.considered ? 100.0 * t.rejected / t.considered : 0.0);
+    lines.push_back(buf);
+    std::snprintf(buf, sizeof(buf), "tasks %ld, avg queue wait %.3f ms, avg run %.3f ms",
+                  t.tasks, t.tasks ? t.queue_wait_ms / t.tasks : 0.0, t.tasks ? t.task_run_ms / t.tasks : 0.0);
+    lines.push_back(buf);
+    std::snprintf(buf, sizeof(buf), "waiting for tasks %.1f ms (%.3f ms/step)",
+                  t.idle_ms, t.steps ? t.idle_ms / t.steps : 0.0);
+    lines.push_back(buf);
+    std::snprintf(buf, sizeof(buf), "input latency p50 %.2f ms, p99 %.2f ms, max %.2f ms (%ld keys)",
+                  latency.percentile(0.5), latency.percentile(0.99), latency.max(), latency.count());
+    lines.push_back(buf);
+    if (t.speculated > 0) {
+        std::snprintf(buf, sizeof(buf), "pipeline: %ld of %ld prefetched steps used",
+                      t.speculation_hits, t.speculated);
+        lines.push_back(buf);
+    }
+
+    attron(A_REVERSE);
+    for (size_t i = 0; i < lines.size() && static_cast<int>(i) + 1 < row; ++i) {
+        if (static_cast<int>(lines[i].size()) > col - 1) lines[i].erase(col - 1);
+        mvaddstr(static_cast<int>(i) + 1, 0, lines[i].c_str());
+    }
+    attroff(A_REVERSE);
+}
+
+// Deliver a single trigger key to the running program
+KeyOutcome deliver_key(Session &s, Derivation &w, const Grammar2D &cfg, wint_t wch,
+                       int row, int col, std::vector<wchar_t> &applied_sounds) {
+    //restart scene
+    // Translate user input for control keys
+    wchar_t control_key = cfg.getControlKey(wch);
+
+    if (control_key == L'x') {
+        s.paused = true;
+        w.reset(cfg, row, col);
+        w.init(true);
+        w.start();
+        return KeyOutcome::Restarted;
+    }
+    // toggle pause
+    if (control_key == L' ') {
+        s.paused = !s.paused;
+        return KeyOutcome::Toggled;
+    }
+    // toggle scheduler metrics overlay (rule key unless asked for)
+    if (control_key == L'o' && s.overlay_key) {
+        s.overlay = !s.overlay;
+        if (!s.overlay) w.redraw();
+        return KeyOutcome::Toggled;
+    }
+    // rewind the last step or redo a rewound one (rule keys when #undo is 0)
+    if ((control_key == L'z' || control_key == L'y') && w.rewinding()) {
+        if (control_key == L'z') {
+            w.rewind(s.score);
+        } else {
+            w.forward(s.score);
+        }
+        return KeyOutcome::Rewound;
+    }
+    // scroll viewport by half a screen (only when the world exceeds the terminal)
+    if (w.scrollable()) {
+        int dr = control_key == L'K' ? -(row - 1) / 2 : control_key == L'J' ? (row - 1) / 2 : 0;
+        int dc = control_key == L'H' ? -col / 2 : control_key == L'L' ? col / 2 : 0;
+        if (dr != 0 || dc != 0) {
+            w.scrollView(dr, dc);
+            return KeyOutcome::Scrolled;
+        }
+    }
+    if (control_key == L'q' && !s.success && s.paused) {
+        s.config = "quit";
+        return KeyOutcome::Quit;
+    }
+    // Emergency exit (ESC) - always works, bypasses dictionary
+    if (wch == 27) { // ESC key
+        s.config = "quit";
+        return KeyOutcome::Quit;
+    }
+    // apply a single rule (counts as a step)
+    s.rule.sound = 0;
+    applied_sounds.clear();
+    s.success = w.stepMultithreaded(control_key, s.score, &s.rule, &applied_sounds);
+    if (s.success) {
+        ++s.steps;
+    }
+    return KeyOutcome::Stepped;
+}
+
+// Feed a recorded key log back without terminal output, as fast as possible
+int run_replay(Session &s, Derivation &w, KeyReplayer &replay) {
+    int row = 0, col = 0;
+    replay.syncSize(row, col);
+
+    w.headless = true;
+
+    bool clear = true;
+    int keys = 0;
+    int settled_step = -1;  // first step at which the scene settled
+    std::vector<wchar_t> applied_sounds;
+    auto start = std::chrono::steady_clock::now();
+
+    w.seed(replay.seed);
+
+    while (s.config != "quit") {
+        Grammar2D cfg;
+        if (!load_program(cfg, s.config, replay.threads)) {
+            std::cerr << "Program " << s.config << " not found, exiting." << std::endl;
+            return 1;
+        }
+        replay.syncSize(row, col);
+        w.reset(cfg, row, col);
+        w.init(clear || cfg.clear_requested);
+        clear = false;
+        w.start();
+
+        s.success = true;
+        s.rule = {};
+
+        while (true) {
+            follow_section_switch(s, w, cfg, nullptr, 0, 0.0, replay.threads);
+            if (follow_program_switch(s, cfg)) {
+                break;
+            }
+            auto event = replay.next();
+            if (event.kind == KeyReplayer::Event::End) {
+                s.config = "quit";
+                break;
+            }
+            if (event.kind == KeyReplayer::Event::Size) {
+                row = event.row;
+                col = event.col;
+                continue;
+            }
+            if (event.step != s.steps) {
+                std::cerr << "Replay diverged at line " << replay.line << ": step "
+                          << s.steps << ", recorded " << event.step << std::endl;
+                return 1;
+            }
+            ++keys;
+            if (deliver_key(s, w, cfg, event.key, row, col, applied_sounds) == KeyOutcome::Quit) {
+                break;
+            }
+            if (settled_step < 0 && (s.settled = w.settled(cfg.timerKeys())) != 0) {
+                settled_step = s.steps;
+            }
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Replayed " << keys << " keys: " << s.steps << " steps, score " << s.score
+              << " in " << elapsed.count() << " s (" << static_cast<long>(s.steps / elapsed.count())
+              << " steps/s)" << std::endl;
+    if (settled_step >= 0) {
+        std::cout << "Settled at step " << settled_step;
+        if (s.settled == 1) {
+            std::cout << " (fixed point)" << std::endl;
+        } else {
+            std::cout << " (cycle of " << s.settled << " steps)" << std::endl;
+        }
+    }
+    return 0;
+}
+
+// Outcome of one headless batch run
+struct BatchRun {
+    int score = 0;
+    int steps = 0;
+    int settled = 0;  // stopped at a fixed point (1) or in a cycle of this many steps
+    std::unordered_map<std::wstring, long> usage;  // applications per rule header
+};
+
+// Run a program headless driven by its timers (1 ms of virtual time per iteration)
+BatchRun run_batch_instance(const std::string &config, unsigned int seed, int step_limit,
+                            int row, int col, int auto_threads) {
+    BatchRun result;
+    Session s;
+    s.config = config;
+    s.paused = false;
+
+    Derivation w;
+    w.headless = true;
+    w.inline_apply = true;
+    w.track_usage = true;
+    w.rewindable = false;
+    w.seed(seed);
+
+    bool clear = true;
+    std::vector<wchar_t> applied_sounds;
+
+    while (s.config != "quit" && s.steps < step_limit && !result.settled) {
+        Grammar2D cfg;
+        if (!load_program(cfg, s.config, auto_threads)) {
+            break;
+        }
+        w.reset(cfg, row, col);
+        w.init(clear || cfg.clear_requested);
+        clear = false;
+        w.start();
+
+        s.success = true;
+        s.rule = {};
+        Timers timers(cfg, seed);
+
+        for (long tick = 1; s.steps < step_limit; ++tick) {
+            follow_section_switch(s, w, cfg, &timers, seed, tick, auto_threads);
+            if (follow_program_switch(s, cfg)) {
+                break;
+            }
+            wint_t key = timers.due(tick);
+            if (key == 0) {
+                continue;
+            }
+            if (deliver_key(s, w, cfg, key, row, col, applied_sounds) == KeyOutcome::Quit) {
+                break;
+            }
+            result.settled = w.settled(cfg.timerKeys());
+            if (result.settled) {
+                break;
+            }
+        }
+
+        // Rule indices refer to this program, resolve them to headers now
+        for (const auto &[rule, count] : w.rule_usage) {
+            const auto &rules = w.grammar().R.at(rule.first);
+            result.usage[rules[rule.second].lhsa + L" [" + std::to_wstring(rule.second) + L"]"] += count;
+        }
+        w.rule_usage.clear();
+    }
+
+    result.score = s.score;
+    result.steps = s.steps;
+    return result;
+}
+
+// Run many seeds of a program concurrently and print aggregated statistics
+int run_batch(const std::string &config, unsigned int seed, int runs, int step_limit,
+              int jobs, int row, int col, int auto_threads) {
+    std::vector<BatchRun> results(runs);
+    std::atomic<int> next{0};
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs; ++j) {
+        workers.emplace_back([&] {
+            for (int i = next++; i < runs; i = next++) {
+                results[i] = run_batch_instance(config, seed + i, step_limit, row, col, auto_threads);
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    long score_sum = 0, steps_sum = 0;
+    int score_min = INT_MAX, score_max = INT_MIN, steps_min = INT_MAX, steps_max = 0, fixed = 0, cycling = 0;
+    std::unordered_map<std::wstring, long> usage;
+    for (const auto &r : results) {
+        score_sum += r.score;
+        steps_sum += r.steps;
+        score_min = std::min(score_min, r.score);
+        score_max = std::max(score_max, r.score);
+        steps_min = std::min(steps_min, r.steps);
+        steps_max = std::max(steps_max, r.steps);
+        if (r.settled == 1) ++fixed;
+        if (r.settled > 1) ++cycling;
+        for (const auto &[header, count] : r.usage) {
+            usage[header] += count;
+        }
+    }
+
+    std::cout << "Batch: " << runs << " runs of " << config << ", seeds " << seed << ".." << seed + runs - 1
+              << ", step limit " << step_limit << ", " << jobs << " jobs, " << elapsed.count() << " s" << std::endl
+              << "Score: mean " << static_cast<double>(score_sum) / runs
+              << ", min " << score_min << ", max " << score_max << std::endl
+              << "Steps: mean " << static_cast<double>(steps_sum) / runs
+              << ", min " << steps_min << ", max " << steps_max << std::endl
+              << "Settled: " << fixed << " runs at a fixed point, " << cycling << " in a cycle" << std::endl
+              << "Rule usage:" << std::endl;
+
+    std::vector<std::pair<std::wstring, long>> sorted(usage.begin(), usage.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    for (const auto &[header, count] : sorted) {
+        std::cout << "  " << count << "\t" << to_utf8(header) << std::endl;
+    }
+    return 0;
+}
+
+// Time dry-run matching of all trigger keys on the current scene for every cell layout
+void run_bench(Derivation &w, int rounds) {
+    auto keys = w.triggerKeys();
+    for (auto layout : {World::ROWS, World::TILES, World::MORTON}) {
+        w.setLayout(layout);
+        size_t matches = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            for (wchar_t key : keys) {
+                matches += w.gatherApplicableRules(key).size();
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Layout " << World::layoutName(layout) << ": " << rounds << " rounds, "
+                  << matches << " matches in " << elapsed.count() << " s ("
+                  << static_cast<long>(rounds / elapsed.count()) << " rounds/s)" << std::endl;
+    }
+}
+
 int main(int argc, char *argv[]) {
     setlocale(LC_ALL, "");
 
-    if (argc > 1) {
-        auto param = std::string(argv[1]);
+    std::vector<std::string> args;
+    std::string record_path;
+    std::string replay_path;
+    std::string metrics_path;
+    std::string pack_path;
+    std::string make_pack_path;
+    int budget_us = -1;
+    bool watch = false;
+    bool overlay = false;
+    int bench_rounds = 0;
+    int batch_runs = 0;
+    int batch_steps = 10000;
+    int batch_jobs = 0;
+    int batch_row = 40, batch_col = 120;
+
+    for (int i = 1; i < argc; ++i) {
+        auto param = std::string(argv[i]);
         if (param == "-h" || param == "--help") {
             std::cout
-                    << "Usage: ./zahradnice [<program.cfg>] [seed] [max-threads]"
+                    << "Usage: ./zahradnice [options] [<program.cfg>] [seed] [max-threads]"
                     << std::endl
-                    << "  program.cfg  - Program to run (default: current directory)"
+                    << "  program.cfg      - Program to run (default: current directory)"
                     << std::endl  
-                    << "  seed         - Random seed (default: time-based)"
+                    << "  seed             - Random seed (default: time-based)"
+                    << std::endl
+                    << "  max-threads      - Maximum worker threads (default: hardware cores)"
+                    << std::endl
+                    << "  --record <file>  - Log delivered trigger keys for a later replay"
+                    << std::endl
+                    << "  --replay <file>  - Replay a key log without terminal, as fast as possible"
+                    << std::endl
+                    << "  --bench <rounds> - After replay, time rule matching for each cell layout"
+                    << std::endl
+                    << "  --batch <runs>   - Run many seeds (seed, seed+1, ...) headless and summarize"
+                    << std::endl
+                    << "  --steps <limit>  - Batch step limit per run (default: 10000)"
+                    << std::endl
+                    << "  --jobs <n>       - Batch runs in parallel (default: hardware cores)"
+                    << std::endl
+                    << "  --size <r>x<c>   - Batch world size without terminal (default: 40x120)"
+                    << std::endl
+                    << "  --metrics <sock> - Serve live metrics on a Unix socket (see zahradnice-top)"
+                    << std::endl
+                    << "  --budget <us>    - Time limit of timer steps (overrides #budget, 0 = none)"
+                    << std::endl
+                    << "  --watch          - Reload the program when its file is saved, keeping the scene"
                     << std::endl
-                    << "  max-threads  - Maximum worker threads (default: hardware cores)"
+                    << "  --overlay        - Show parallel execution statistics, toggled with o"
+                    << std::endl
+                    << "  --pack <file>    - Load programs and sounds from an archive instead of files"
+                    << std::endl
+                    << "  --make-pack <file> <path>... - Write programs and sounds into an archive"
                     << std::endl;
             return 0;
         }
+        if (param == "--record" && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (param == "--replay" && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (param == "--bench" && i + 1 < argc) {
+            bench_rounds = std::atoi(argv[++i]);
+        } else if (param == "--batch" && i + 1 < argc) {
+            batch_runs = std::atoi(argv[++i]);
+        } else if (param == "--steps" && i + 1 < argc) {
+            batch_steps = std::atoi(argv[++i]);
+        } else if (param == "--jobs" && i + 1 < argc) {
+            batch_jobs = std::atoi(argv[++i]);
+        } else if (param == "--budget" && i + 1 < argc) {
+            budget_us = std::max(0, std::atoi(argv[++i]));
+        } else if (param == "--metrics" && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (param == "--watch") {
+            watch = true;
+        } else if (param == "--overlay") {
+            overlay = true;
+        } else if (param == "--pack" && i + 1 < argc) {
+            pack_path = argv[++i];
+        } else if (param == "--make-pack" && i + 1 < argc) {
+            make_pack_path = argv[++i];
+        } else if (param == "--size" && i + 1 < argc) {
+            std::sscanf(argv[++i], "%dx%d", &batch_row, &batch_col);
+        } else {
+            args.push_back(param);
+        }
+    }
+
+    if (!make_pack_path.empty()) {
+        // Sounds are stored in the format of the opened mixer
+        Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024);
+        bool packed = Pack::write(make_pack_path, args);
+        Mix_CloseAudio();
+        if (!packed) {
+            std::cerr << "Cannot write " << make_pack_path << ", exiting." << std::endl;
+            return 1;
+        }
+        std::cout << "Packed " << args.size() << " files into " << make_pack_path << std::endl;
+        return 0;
+    }
+    if (!pack_path.empty() && !Pack::instance().open(pack_path)) {
+        std::cerr << "Cannot read " << pack_path << ", exiting." << std::endl;
+        return 1;
     }
 
     std::string config(".");
-    int seed = 0;
+    unsigned int seed = 0;
     int max_threads = 0; // 0 = auto-detect
 
-    if (argc > 1) config = argv[1];
-    if (argc > 2) seed = std::atoi(argv[2]);
-    if (argc > 3) max_threads = std::atoi(argv[3]);
+    if (args.size() > 0) config = args[0];
+    if (args.size() > 1) seed = std::atoi(args[1].c_str());
+    if (args.size() > 2) max_threads = std::atoi(args[2].c_str());
 
     config = resolve_program_path(config, config);
 
+    int auto_threads = std::thread::hardware_concurrency();
+    if (auto_threads == 0) auto_threads = 1; // fallback
+
+    KeyReplayer replay;
+    if (!replay_path.empty()) {
+        if (!replay.open(replay_path)) {
+            std::cerr << "Replay " << replay_path << " not readable, exiting." << std::endl;
+            return 1;
+        }
+        seed = replay.seed;
+    }
+
+    if (seed == 0) {
+        seed = time(0);
+    }
+
     // Initialize global thread pool with command-line specified max threads
     Derivation::initializeGlobalThreadPool(max_threads);
 
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024) < 0) {
-        //cannot initialize sounds
+    if (batch_runs > 0) {
+        if (batch_jobs <= 0) batch_jobs = auto_threads;
+        return run_batch(config, seed, batch_runs, batch_steps, std::min(batch_jobs, batch_runs),
+                         batch_row, batch_col, auto_threads);
     }
 
-    Mix_AllocateChannels(32);
+    Session s;
+    s.config = config;
 
-    int score = 0;
-    int steps = 0;
-    bool started = false;
+    if (!replay_path.empty()) {
+        Derivation w;
+        int result = run_replay(s, w, replay);
+        if (result == 0 && bench_rounds > 0) {
+            run_bench(w, bench_rounds);
+        }
+        return result;
+    }
 
-    if (seed == 0) {
-        srand(time(0));
+    s.overlay = s.overlay_key = overlay;
+
+    KeyRecorder recorder;
+    if (!record_path.empty() && !recorder.open(record_path, seed, auto_threads)) {
+        std::cerr << "Cannot write " << record_path << ", exiting." << std::endl;
+        return 1;
     }
-    else {
-        srand(seed);
+    // Budgeted steps depend on timing, a replay takes all steps unbudgeted
+    if (!record_path.empty()) {
+        if (budget_us > 0) {
+            std::cerr << "Step budget is off while recording, so that the log replays." << std::endl;
+        }
+        budget_us = 0;
     }
 
+    MetricsPublisher metrics;
+    if (!metrics_path.empty() && !metrics.open(metrics_path)) {
+        std::cerr << "Cannot listen on " << metrics_path << ", exiting." << std::endl;
+        return 1;
+    }
+
+    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024) < 0) {
+        //cannot initialize sounds
+    }
+
+    Mix_AllocateChannels(SOUND_CHANNELS);
+
     int row, col;
 
     initscr();
@@ -154,100 +740,131 @@ int main(int argc, char *argv[]) {
     curs_set(0);
 
     Derivation w;
-    std::vector<std::string> caller_stack;  // Stack of calling programs
+    w.seed(seed);
+
+    // Keys read but not delivered yet (kept across program switches) with
+    // their earliest possible arrival, and time from it to the handled step
+    // (an upper bound of the latency for keys read without waiting)
+    struct PendingKey {
+        wint_t key;
+        std::chrono::steady_clock::time_point arrived;
+    };
+    std::deque<PendingKey> pending;
+    LatencyHistogram latency;
+    FileWatcher watcher;
 
     bool clear = true;  // Clear on first program load
     bool err = 0;
-    bool paused = true;
-    while (config != "quit") {
-        int elapsed_t = 0;
-        int elapsed_b = 0;
-        int elapsed_m = 0;
-
-        bool success = true;
-
+    while (s.config != "quit") {
         Grammar2D cfg;
-        if (cfg.loadFromFile(config) == false) {
-            std::cerr << "Program " << config << " not found, exiting." << std::endl;
+        if (!load_program(cfg, s.config, auto_threads, budget_us)) {
+            std::cerr << "Program " << s.config << " not found, exiting." << std::endl;
             err = 1;
             break;
         }
-
-        // Auto-detect thread count if not set
-        if (cfg.thread_count == 0) {
-            cfg.thread_count = std::thread::hardware_concurrency();
-            if (cfg.thread_count == 0) cfg.thread_count = 1; // fallback
-        }
+        metrics.program(s.config);
 
         // Get program directory for sound path resolution
         std::string program_dir = ".";
-        size_t last_slash = config.find_last_of("/");
+        size_t last_slash = s.config.find_last_of("/");
         if (last_slash != std::string::npos) {
-            program_dir = config.substr(0, last_slash);
+            program_dir = s.config.substr(0, last_slash);
         }
 
-        std::unordered_map<wchar_t, sample> sounds;
+        // Samples by resolved path, shared by the characters mapped to them
+        std::unordered_map<std::string, sample> sounds;
         // Use pre-parsed timing values
-        int B = cfg.B_step;
-        int M = cfg.M_step;
-        int T = cfg.T_step;
+        Timers timers(cfg, seed);
 
         // Load sounds from pre-parsed paths with proper resolution
-        for (const auto& sound_entry : cfg.sound_paths) {
-            std::string resolved_path = resolve_sound_path(sound_entry.second, program_dir);
-            sounds.insert({sound_entry.first, sample(resolved_path, 100)});
+        sound_scheduler scheduler(SOUND_CHANNELS);
+        for (const auto &[sound_char, sound_path] : cfg.sound_paths) {
+            std::string resolved_path = resolve_sound_path(sound_path, program_dir);
+            auto smp = sounds.try_emplace(resolved_path, resolved_path, 100).first;
+            auto opt = cfg.sound_options.find(sound_char);
+            auto options = opt != cfg.sound_options.end() ? opt->second : Grammar2D::SoundOptions{};
+            scheduler.add(sound_char, resolved_path, &smp->second, options.interval, options.priority);
         }
 
         // Control key translation handled by reverse dictionary mappings
 
         getmaxyx(stdscr, row, col);
+        recorder.size(row, col);
 
         //top row reserved as status line
         w.reset(cfg, row, col);
         w.init(clear || cfg.clear_requested);
         clear = false;  // Subsequent program switches preserve state
         w.start();
+        if (watch) watcher.open(cfg.path);
 
         wint_t wch = L' ';
         wint_t last = L' ';
+        uint64_t last_hash = 0;
 
-        Grammar2D::Rule rule = {};  // Initialize all members to zero/false
+        s.success = true;
+        s.rule = {};
+        std::vector<wchar_t> applied_sounds;
 
         auto start = std::chrono::steady_clock::now();
+        auto frame_begin = start;
+        auto input_empty = start;  // input was last seen empty
 
         while (true) {
-            // switch programs if requested (check first)
-            if (success && rule.load && rule.sound != 0) {
-                // Look up program path from dictionary
-                auto it = cfg.program_paths.find(rule.sound);
-                if (it != cfg.program_paths.end()) {
-                    std::string new_program = it->second;
-                    if (new_program == "return") {
-                        // Pop from caller stack
-                        if (!caller_stack.empty()) {
-                            config = caller_stack.back();
-                            caller_stack.pop_back();
-                        } else {
-                            config = "quit";  // No caller to return to
-                        }
+            // switch sections or programs if requested (check first)
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            if (follow_section_switch(s, w, cfg, &timers, seed, elapsed.count(), auto_threads, budget_us)) {
+                metrics.program(s.config);
+            }
+            if (follow_program_switch(s, cfg)) {
+                break;
+            }
+            // Take over a saved program; rules of unchanged symbols are kept
+            // compiled, the scene stays unless the grid or world size changed
+            if (watcher.active() && watcher.changed()) {
+                Grammar2D edited;
+                if (load_program(edited, s.config, auto_threads, budget_us, &cfg)) {
+                    bool same_world = edited.grid_width == cfg.grid_width && edited.grid_height == cfg.grid_height
+                        && edited.world_width == cfg.world_width && edited.world_height == cfg.world_height;
+                    bool same_timers = edited.timerSpecs() == cfg.timerSpecs();
+                    cfg = std::move(edited);
+                    if (!same_timers) {
+                        std::chrono::duration<double, std::milli> now = std::chrono::steady_clock::now() - start;
+                        timers = Timers(cfg, seed, now.count());
+                    }
+                    if (same_world) {
+                        w.reload(cfg);
+                        if (cfg.layout != w.world.layout()) w.setLayout(cfg.layout);
                     } else {
-                        // Push current program to stack and switch
-                        caller_stack.push_back(config);
-                        config = resolve_program_path(new_program, config);
+                        w.reset(cfg, row, col);
+                        w.init(true);
+                        w.start();
                     }
-                    break;
+                    // Edited rules may change a settled scene again
+                    s.settled = 0;
                 }
             }
+            // Gather the next timer step on the pool while this frame is shown
+            if (cfg.pipeline && !s.paused && s.settled != 1) {
+                std::chrono::duration<double, std::milli> now = std::chrono::steady_clock::now() - start;
+                w.prefetch(timers.upcoming(now.count()));
+            }
             // Sound playing is now handled in the rule application section
 
             // print status
-            auto [parallel, total] = w.getThreadingStats();
-            std::string status_text = "Score: " + std::to_string(score) + " Steps: " + std::to_string(steps);
-            if (total > 0) {
-                status_text += " (" + std::to_string(100 * parallel / total) + "%)";
+            std::string status_text = "Score: " + std::to_string(s.score) + " Steps: " + std::to_string(s.steps);
+            if (w.getThreadingStats().first > 0) {
+                char speedup[16];
+                std::snprintf(speedup, sizeof(speedup), " (%.1fx)", w.getSpeedup());
+                status_text += speedup;
+            }
+            if (s.settled == 1) {
+                status_text += " settled";
+            } else if (s.settled > 1) {
+                status_text += " cycle " + std::to_string(s.settled);
             }
 
-            if (elapsed_b == 0 || paused) {
+            if (timers.fired(L'B') == 0 || s.paused) {
                 auto limit = std::min(static_cast<size_t>(col-1), cfg.help.size());
                 std::wstring help_truncated = cfg.help;
                 help_truncated.erase(limit, std::wstring::npos);
@@ -259,8 +876,8 @@ int main(int argc, char *argv[]) {
                 clear_status(col);
                 if (limit < status_text.length()) status_text.erase(limit);
                 mvprintw(0, 0, status_text.c_str());
-                limit = std::min(static_cast<size_t>(col-1), rule.lhsa.size());
-                std::wstring lhsa_truncated = rule.lhsa;
+                limit = std::min(static_cast<size_t>(col-1), s.rule.lhsa.size());
+                std::wstring lhsa_truncated = s.rule.lhsa;
                 lhsa_truncated.erase(limit, std::wstring::npos);
 
                 // Calculate actual display width (wide chars take 2 columns)
@@ -272,94 +889,101 @@ int main(int argc, char *argv[]) {
                 mvaddwstr(0, start_col, lhsa_truncated.c_str());
             }
 
-            int result = wget_wch(stdscr, &wch);
-            if (result == ERR) {
-                wch = ERR;
+            if (s.overlay) {
+                draw_overlay(w.threadingStats(), latency, row, col);
             }
 
-            //time lapse
-            //save CPU if no rule applicable
-            if (!success && last == wch) {
-                wch = ERR;
+            // Start sounds requested during the last frame
+            auto frame_end = std::chrono::steady_clock::now();
+            std::chrono::duration<double, std::milli> now = frame_end - start;
+            scheduler.dispatch(static_cast<long>(now.count()));
+
+            if (metrics.active()) {
+                std::chrono::duration<double, std::milli> frame = frame_end - frame_begin;
+                metrics.publish(s.steps, s.score, frame.count());
+                if (metrics.wantsScene()) {
+                    metrics.scene(w.nonterminals(), w.world.allocated() * w.world.chunkBytes());
+                }
             }
 
-            if (wch == ERR) {
-                wch = 0;
-                auto stop = std::chrono::steady_clock::now();
-                std::chrono::duration<double, std::milli> duration = stop - start;
-                int el_t = T > 0 ? static_cast<int>(duration.count() / T) : elapsed_t + 1;
-                int el_b = static_cast<int>(duration.count() / B);
-                int el_m = static_cast<int>(duration.count() / M);
-                if (el_t > elapsed_t) {
-                    wch = L'T';
-                    elapsed_t = el_t;
+            // Drain all keys typed since the last frame. Wait for the first
+            // one while paused or settled (forever) or until the next timer
+            // tick. A key read after waiting arrived just now, others at the
+            // earliest when input was last seen empty.
+            if (pending.empty()) {
+                int wait_ms = s.paused || s.settled == 1 ? -1 : timers.wait(now.count());
+                // Look for saved edits a few times a second
+                if (watcher.active() && (wait_ms < 0 || wait_ms > 250)) wait_ms = 250;
+                wint_t key;
+                timeout(wait_ms);
+                if (wget_wch(stdscr, &key) != ERR) {
+                    auto arrived = wait_ms != 0 ? std::chrono::steady_clock::now() : input_empty;
+                    pending.push_back({key, arrived});
+                    timeout(0);
+                    while (wget_wch(stdscr, &key) != ERR) {
+                        pending.push_back({key, arrived});
+                    }
                 }
-                if (el_m > elapsed_m) {
-                    wch = L'M';
-                    elapsed_m = el_m;
+                input_empty = std::chrono::steady_clock::now();
+            }
+            frame_begin = std::chrono::steady_clock::now();
+
+            // User keys first, in order; timers only step when no key is pending
+            bool user = !pending.empty();
+            auto arrived = frame_begin;
+            if (user) {
+                wch = pending.front().key;
+                arrived = pending.front().arrived;
+                pending.pop_front();
+                // A repeated key that found no rule fails again until the scene changes
+                if (!s.success && last == wch && last_hash == w.stateHash()) {
+                    continue;
+                }
+            } else {
+                // The wait only timed out to look for saved edits
+                if (s.paused || s.settled == 1) {
+                    continue;
                 }
-                if (el_b > elapsed_b) {
-                    wch = L'B';
-                    elapsed_b = el_b;
+                std::chrono::duration<double, std::milli> duration = frame_begin - start;
+                wch = timers.due(duration.count());
+                if (wch == 0) {
+                    continue;
                 }
             }
 
-            //restart scene
-            // Translate user input for control keys
-            wchar_t control_key = cfg.getControlKey(wch);
-
-            if (control_key == L'x') {
-                paused = true;
-                timeout(-1);
-                getmaxyx(stdscr, row, col);
-                w.reset(cfg, row, col);
-                w.init(true);
-                w.start();
+            getmaxyx(stdscr, row, col);
+            recorder.size(row, col);
+            // The overlay toggle leaves the scene alone and a replay shows no overlay
+            if (!s.overlay_key || cfg.getControlKey(wch) != L'o') {
+                recorder.key(s.steps, wch);
             }
 
-            // toggle pause
-
-            else if (control_key == L' ') {
-                paused = !paused;
-                if (!paused) {
-                    timeout(0);
-                } else {
-                    timeout(-1);
-                }
-            }
-            else if(control_key == L'q' && !success && paused) {
-                config = "quit";
+            auto outcome = deliver_key(s, w, cfg, wch, row, col, applied_sounds);
+            if (outcome == KeyOutcome::Quit) {
                 break;
             }
-            // Emergency exit (ESC) - always works, bypasses dictionary
-            else if(wch == 27) { // ESC key
-                config = "quit";
-                break;
+            if (user && (outcome == KeyOutcome::Stepped || outcome == KeyOutcome::Rewound)) {
+                std::chrono::duration<double, std::milli> waited = std::chrono::steady_clock::now() - arrived;
+                latency.add(waited.count());
             }
-            // apply a single rule (counts as a step)
-
-            else {
-                // Translate user input to internal control key if remapped
-                wchar_t translated_key = cfg.getControlKey(wch);
-
-                rule.sound = 0;
-                std::vector<wchar_t> applied_sounds;
-                success = w.stepMultithreaded(translated_key, score, &rule, &applied_sounds);
-                if (success) {
-                    ++steps;
-                    // Play all sounds from applied rules
-                    for (wchar_t sound_char : applied_sounds) {
-                        auto it = sounds.find(sound_char);
-                        if (it != sounds.end()) {
-                            it->second.play();
-                        }
-                    }
-                }
-                else if (translated_key == L'T') {
-                    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+            // Wait for input without polling once timers cannot change the scene
+            s.settled = w.settled(cfg.timerKeys());
+            if (outcome != KeyOutcome::Stepped) {
+                continue;
+            }
+            if (s.success) {
+                // Queue sounds from applied rules for the next frame
+                for (wchar_t sound_char : applied_sounds) {
+                    scheduler.request(sound_char);
                 }
-                last = wch;
             }
+            else if (!user && (cfg.getControlKey(wch) == L'T' || timers.continuous(wch)) && !w.partialStep()) {
+                // Back off from polling, but let keys end the wait
+                std::chrono::duration<double, std::milli> failed = std::chrono::steady_clock::now() - start;
+                timers.defer(wch, failed.count() + 50.0);
+            }
+            last = wch;
+            last_hash = w.stateHash();
 
             //refresh();
         }
@@ -367,6 +991,14 @@ int main(int argc, char *argv[]) {
 
     endwin();
 
+    if (latency.count() > 0) {
+        char summary[160];
+        std::snprintf(summary, sizeof(summary), "Input latency: %ld keys, p50 %.2f ms, p99 %.2f ms, max %.2f ms",
+                      latency.count(), latency.percentile(0.5), latency.percentile(0.99), latency.max());
+        std::cout << summary << std::endl;
+    }
+
+    sample_cache::instance().shutdown();
     Mix_CloseAudio();
     Mix_Quit();
 
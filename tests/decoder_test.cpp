@@ -0,0 +1,27 @@
+// Decoding of program text (UTF-8, invalid bytes taken as Latin-1)
+
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include "../src/grammar.h"
+
+static std::wstring help(const std::string &text) {
+    Grammar2D cfg;
+    bool loaded = cfg.loadFromBuffer(text.data(), text.size(), "test.cfg");
+    assert(loaded);
+    return cfg.help;
+}
+
+int main() {
+    // Complete sequences
+    assert(help("#!a\xC3\xA9\xE2\x82\xAC\n") == L"aé€");
+    // A 3-byte sequence cut short by an ASCII character: both bytes read stay
+    assert(help("#!a\xE2\x82Z\n") == std::wstring(L"aâ\u0082Z"));
+    // ... by a new lead byte
+    assert(help("#!\xE2\x82\xC3\xA9\n") == std::wstring(L"â\u0082é"));
+    // ... by the end of a line and of the text
+    assert(help("#!\xE2\x82\n") == std::wstring(L"â\u0082"));
+    assert(help("#!\xE2\x82") == std::wstring(L"â\u0082"));
+    std::printf("decoder: ok\n");
+    return 0;
+}
@@ -0,0 +1,53 @@
+// Timer channel scheduling (see src/timers.h)
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include "../src/timers.h"
+
+static Grammar2D program(const char *text) {
+    Grammar2D cfg;
+    bool loaded = cfg.loadFromBuffer(text, std::strlen(text), "test.cfg");
+    assert(loaded);
+    return cfg;
+}
+
+// Two continuous channels (T with step 0 and a #timer of period 0) take turns
+static void continuousChannelsAlternate() {
+    Grammar2D cfg = program("#timing 500 50 0\n#timer A 0\n");
+    Timers timers(cfg, 1);
+    long t = 0, a = 0;
+    for (int ms = 1; ms <= 400; ++ms) {
+        wint_t key = timers.due(ms);
+        if (key == L'T') ++t;
+        if (key == L'A') ++a;
+    }
+    assert(a > 0);
+    assert(t - a <= 1 && a - t <= 1);
+}
+
+// A periodic channel takes precedence over continuous ones when due
+static void periodicChannelFirst() {
+    Grammar2D cfg = program("#timing 500 50 0\n#timer A 0\n");
+    Timers timers(cfg, 1);
+    for (int ms = 1; ms < 50; ++ms) timers.due(ms);
+    assert(timers.due(50) == L'M');
+}
+
+// Channels started later (timer lines changed by a reload) do not make up
+// the ticks before
+static void startedLater() {
+    Grammar2D cfg = program("#timing 500 50 20\n");
+    Timers timers(cfg, 1, 10000.0);
+    assert(timers.due(10000.0) == 0);
+    assert(timers.due(10020.0) == L'T');
+    assert(timers.due(10020.0) == 0);
+}
+
+int main() {
+    continuousChannelsAlternate();
+    periodicChannelFirst();
+    startedLater();
+    std::printf("timers: ok\n");
+    return 0;
+}